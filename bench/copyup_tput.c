@@ -0,0 +1,107 @@
+/*
+ * copyup_tput: open a file that only exists in the right branch for
+ * writing, which copies it up, and print how long that took and the
+ * MB/s.  With -c, copy the file to dest with read and write instead
+ * (and fsync it, as copy-up does), which run on the right branch file
+ * gives the user space copy to compare against.
+ *
+ * usage: copyup_tput [-c dest] file
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void copy_file(const char *src, const char *dest)
+{
+	static char buf[1 << 20];
+	int in, out;
+	ssize_t n;
+
+	in = open(src, O_RDONLY);
+	if (in < 0) {
+		perror(src);
+		exit(1);
+	}
+	out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		perror(dest);
+		exit(1);
+	}
+	while ((n = read(in, buf, sizeof(buf))) > 0) {
+		if (write(out, buf, n) != n) {
+			perror(dest);
+			exit(1);
+		}
+	}
+	if (n < 0) {
+		perror(src);
+		exit(1);
+	}
+	if (fsync(out) < 0) {
+		perror(dest);
+		exit(1);
+	}
+	close(out);
+	close(in);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dest = NULL;
+	const char *file;
+	struct stat st;
+	double t;
+	int fd, c;
+
+	while ((c = getopt(argc, argv, "c:")) != -1) {
+		switch (c) {
+		case 'c':
+			dest = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+	file = argv[optind];
+
+	if (stat(file, &st) < 0) {
+		perror(file);
+		return 1;
+	}
+	t = now();
+	if (dest) {
+		copy_file(file, dest);
+	} else {
+		fd = open(file, O_WRONLY);
+		if (fd < 0) {
+			perror(file);
+			return 1;
+		}
+		close(fd);
+	}
+	t = now() - t;
+
+	printf("%s %lld bytes in %.3f s, %.1f MB/s\n",
+	       dest ? "copy" : "copy-up", (long long)st.st_size, t,
+	       t > 0 ? st.st_size / t / (1 << 20) : 0);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-c dest] file\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,144 @@
+/*
+ * lookup_scale: stat the entries of one directory from more and more
+ * threads at once, to see how path walks through u2fs scale with the
+ * number of CPUs.  Each thread stats every entry in turn; the directory
+ * is only read once, up front.  Compare a u2fs mount with its lower
+ * directory, or one u2fs build with another.
+ *
+ * usage: lookup_scale [-t max_threads] [-s seconds] dir
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct worker {
+	pthread_t tid;
+	int id;
+	unsigned long ops;
+};
+
+static char **paths;
+static int npaths;
+static volatile int stop;
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	struct stat st;
+	unsigned long ops = 0;
+	int i = w->id;
+
+	while (!stop) {
+		if (stat(paths[i], &st) < 0) {
+			perror(paths[i]);
+			exit(1);
+		}
+		if (++i == npaths)
+			i = 0;
+		ops++;
+	}
+	w->ops = ops;
+	return NULL;
+}
+
+static void read_dir(const char *dir)
+{
+	struct dirent *de;
+	DIR *d;
+	int size = 0;
+
+	d = opendir(dir);
+	if (!d) {
+		perror(dir);
+		exit(1);
+	}
+	while ((de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (npaths == size) {
+			size = size ? 2 * size : 64;
+			paths = realloc(paths, size * sizeof(*paths));
+			if (!paths) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		if (asprintf(&paths[npaths++], "%s/%s", dir, de->d_name) < 0) {
+			perror("asprintf");
+			exit(1);
+		}
+	}
+	closedir(d);
+	if (!npaths) {
+		fprintf(stderr, "%s: no entries to stat\n", dir);
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int seconds = 5;
+	struct worker *w;
+	unsigned long total;
+	int n, i, c;
+
+	while ((c = getopt(argc, argv, "t:s:")) != -1) {
+		switch (c) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || max_threads < 1 || seconds < 1)
+		goto usage;
+	read_dir(argv[optind]);
+
+	w = calloc(max_threads, sizeof(*w));
+	if (!w) {
+		perror("calloc");
+		return 1;
+	}
+	printf("%d entries, %d s per run\n", npaths, seconds);
+	printf("%8s %14s %14s\n", "threads", "stats/s", "stats/s/thread");
+	for (n = 1; ; n *= 2) {
+		if (n > max_threads)
+			n = max_threads;
+		stop = 0;
+		for (i = 0; i < n; i++) {
+			w[i].id = i % npaths;
+			if (pthread_create(&w[i].tid, NULL, worker_fn, &w[i])) {
+				perror("pthread_create");
+				return 1;
+			}
+		}
+		sleep(seconds);
+		stop = 1;
+		total = 0;
+		for (i = 0; i < n; i++) {
+			pthread_join(w[i].tid, NULL);
+			total += w[i].ops;
+		}
+		printf("%8d %14lu %14lu\n", n, total / seconds,
+		       total / seconds / n);
+		if (n == max_threads)
+			break;
+	}
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-t max_threads] [-s seconds] dir\n",
+		argv[0]);
+	return 1;
+}
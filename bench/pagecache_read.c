@@ -0,0 +1,136 @@
+/*
+ * pagecache_read: read one file sequentially twice, then in random 4k
+ * blocks, and print the throughput of each pass.  The first pass starts
+ * with the file dropped from the page cache (as far as fadvise can drop
+ * it), the second finds it cached.  Compare a "pagecache" mount with a
+ * default one, or with the lower file itself.
+ *
+ * usage: pagecache_read [-b block_size] [-r random_reads] file
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RANDOM_BLOCK	4096
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, unsigned long long bytes, double secs)
+{
+	printf("%-12s %14llu %10.3f %12.1f\n", name, bytes, secs,
+	       secs > 0 ? bytes / secs / (1 << 20) : 0);
+}
+
+static unsigned long long read_seq(int fd, char *buf, size_t bs)
+{
+	unsigned long long total = 0;
+	ssize_t n;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		perror("lseek");
+		exit(1);
+	}
+	while ((n = read(fd, buf, bs)) > 0)
+		total += n;
+	if (n < 0) {
+		perror("read");
+		exit(1);
+	}
+	return total;
+}
+
+static unsigned long long read_random(int fd, char *buf, off_t size,
+				      long count)
+{
+	unsigned long long total = 0;
+	off_t blocks = size / RANDOM_BLOCK;
+	ssize_t n;
+	long i;
+
+	srandom(1);
+	for (i = 0; i < count; i++) {
+		off_t off = (off_t)(random() % blocks) * RANDOM_BLOCK;
+
+		n = pread(fd, buf, RANDOM_BLOCK, off);
+		if (n < 0) {
+			perror("pread");
+			exit(1);
+		}
+		total += n;
+	}
+	return total;
+}
+
+int main(int argc, char **argv)
+{
+	size_t bs = 1 << 20;
+	long count = 100000;
+	unsigned long long bytes;
+	struct stat st;
+	double t;
+	char *buf;
+	int fd, c;
+
+	while ((c = getopt(argc, argv, "b:r:")) != -1) {
+		switch (c) {
+		case 'b':
+			bs = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			count = atol(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || bs < RANDOM_BLOCK || count < 0)
+		goto usage;
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (st.st_size < RANDOM_BLOCK) {
+		fprintf(stderr, "%s: file is too small\n", argv[optind]);
+		return 1;
+	}
+	buf = malloc(bs);
+	if (!buf) {
+		perror("malloc");
+		return 1;
+	}
+
+	printf("%-12s %14s %10s %12s\n", "pass", "bytes", "seconds", "MB/s");
+	fsync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	t = now();
+	bytes = read_seq(fd, buf, bs);
+	report("cold seq", bytes, now() - t);
+
+	t = now();
+	bytes = read_seq(fd, buf, bs);
+	report("cached seq", bytes, now() - t);
+
+	t = now();
+	bytes = read_random(fd, buf, st.st_size, count);
+	report("random 4k", bytes, now() - t);
+	close(fd);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-b block_size] [-r random_reads] file\n",
+		argv[0]);
+	return 1;
+}
@@ -0,0 +1,103 @@
+/*
+ * sendfile_tput: sendfile one file into a socket a number of times and
+ * print the throughput.  A second thread drains the other end of the
+ * socket pair.  sendfile goes through the splice_read of the file, so
+ * comparing a u2fs file with the same lower file shows what the splice
+ * passthrough costs.
+ *
+ * usage: sendfile_tput [-n passes] file
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *drain_fn(void *arg)
+{
+	int sock = *(int *)arg;
+	static char buf[1 << 16];
+
+	while (read(sock, buf, sizeof(buf)) > 0)
+		;
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long total = 0;
+	int passes = 10;
+	int sv[2], fd, c, i;
+	pthread_t drain;
+	struct stat st;
+	ssize_t n;
+	off_t off;
+	double t;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			passes = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || passes < 1)
+		goto usage;
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+	if (pthread_create(&drain, NULL, drain_fn, &sv[1])) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	t = now();
+	for (i = 0; i < passes; i++) {
+		off = 0;
+		while (off < st.st_size) {
+			n = sendfile(sv[0], fd, &off, st.st_size - off);
+			if (n < 0) {
+				perror("sendfile");
+				return 1;
+			}
+			if (!n)
+				break;
+			total += n;
+		}
+	}
+	t = now() - t;
+	close(sv[0]);
+	pthread_join(drain, NULL);
+
+	printf("%llu bytes in %d passes, %.3f s, %.1f MB/s\n", total, passes,
+	       t, t > 0 ? total / t / (1 << 20) : 0);
+	close(fd);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-n passes] file\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 1998-2011 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2011 Stony Brook University
+ * Copyright (c) 2003-2011 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "wrapfs.h"
+#include <linux/splice.h>
+
+/*
+ * In-kernel copies between lower files, by splicing them through a pipe.
+ * Clones are left to the lower file system: the only way to ask one of
+ * this kernel for a clone is its clone ioctl, which takes the source as a
+ * file descriptor, so u2fs passes the clone ioctls on when the caller's
+ * source descriptor is one the lower file system can use itself.
+ */
+
+/* bytes spliced between checks for fatal signals */
+#define U2FS_COPY_CHUNK (1 << 20)
+
+/*
+ * Copy @len bytes by splicing them through a pipe.  do_splice_direct
+ * writes at the f_pos of its output, so this uses a private lower file
+ * rather than moving the position of one others may be using.
+ */
+static loff_t u2fs_splice_lower(struct file *dst, loff_t dst_off,
+				struct file *src, loff_t src_off, loff_t len)
+{
+	struct path lower_path;
+	struct file *out;
+	loff_t copied = 0;
+	long n = 0;
+
+	pathcpy(&lower_path, &dst->f_path);
+	path_get(&lower_path);
+	out = dentry_open(lower_path.dentry, lower_path.mnt,
+			  O_WRONLY | O_LARGEFILE, dst->f_cred);
+	if (IS_ERR(out))
+		return PTR_ERR(out);
+	out->f_pos = dst_off;
+
+	while (copied < len) {
+		n = do_splice_direct(src, &src_off, out,
+				     min_t(loff_t, len - copied,
+					   U2FS_COPY_CHUNK),
+				     SPLICE_F_MOVE);
+		if (n <= 0)
+			break;
+		copied += n;
+		if (fatal_signal_pending(current)) {
+			n = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	fput(out);
+
+	return copied ? copied : n;
+}
+
+/* the last resort, for lower files that cannot splice */
+static loff_t u2fs_rw_lower(struct file *dst, loff_t dst_off,
+			    struct file *src, loff_t src_off, loff_t len)
+{
+	mm_segment_t old_fs;
+	loff_t copied = 0;
+	ssize_t n = 0, w;
+	char *buf;
+
+	buf = (char *)__get_free_page(GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	while (copied < len) {
+		n = vfs_read(src, (char __user *)buf,
+			     min_t(loff_t, len - copied, PAGE_SIZE), &src_off);
+		if (n <= 0)
+			break;
+		w = vfs_write(dst, (const char __user *)buf, n, &dst_off);
+		if (w != n) {
+			n = w < 0 ? w : -EIO;
+			break;
+		}
+		copied += n;
+		if (fatal_signal_pending(current)) {
+			n = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	set_fs(old_fs);
+
+	free_page((unsigned long)buf);
+	return n < 0 ? n : copied;
+}
+
+/*
+ * Copy @len bytes at @src_off of the lower file @src to @dst at @dst_off.
+ * Returns the number of bytes copied, which is short if the source ends
+ * first, or -errno.
+ */
+loff_t u2fs_copy_lower(struct file *dst, loff_t dst_off,
+		       struct file *src, loff_t src_off, loff_t len)
+{
+	loff_t size = i_size_read(src->f_path.dentry->d_inode);
+	loff_t copied;
+
+	if (src_off >= size || len <= 0)
+		return 0;
+	if (len > size - src_off)
+		len = size - src_off;
+
+	copied = u2fs_splice_lower(dst, dst_off, src, src_off, len);
+	/* splice itself is not supported by one of them */
+	if (copied == -EINVAL)
+		return u2fs_rw_lower(dst, dst_off, src, src_off, len);
+	return copied;
+}
+
+/*
+ * Copy @len bytes at @pos of @src to the same place in @dst, which must
+ * read as zeroes there, skipping the holes of @src so that @dst keeps
+ * them.  Returns the number of bytes of the range done, holes included,
+ * which is short if the source ends first, or -errno.  @src's position
+ * is moved, so it has to be a file of u2fs' own.
+ */
+loff_t u2fs_copy_sparse(struct file *dst, struct file *src, loff_t pos,
+			loff_t len)
+{
+	loff_t start = pos, end = pos + len;
+	loff_t data, hole, copied;
+
+	while (pos < end) {
+		data = vfs_llseek(src, pos, SEEK_DATA);
+		/* only holes up to the end of the source */
+		if (data == -ENXIO)
+			break;
+		/* the source cannot tell, so all of it is data */
+		if (data < 0) {
+			copied = u2fs_copy_lower(dst, pos, src, pos, end - pos);
+			return copied < 0 ? copied : pos + copied - start;
+		}
+		if (data >= end)
+			break;
+		hole = vfs_llseek(src, data, SEEK_HOLE);
+		if (hole < 0 || hole > end)
+			hole = end;
+
+		copied = u2fs_copy_lower(dst, data, src, data, hole - data);
+		if (copied < 0)
+			return copied;
+		if (copied < hole - data)
+			return data + copied - start;
+		pos = hole;
+	}
+	/* the holes count as far as the source goes */
+	end = min_t(loff_t, end, i_size_read(src->f_path.dentry->d_inode));
+	return max_t(loff_t, end - start, 0);
+}
+
+/*
+ * BTRFS_IOC_CLONE and BTRFS_IOC_CLONE_RANGE on @file are passed on to its
+ * left lower file unchanged when the source descriptor in @arg is a file
+ * on the same superblock, which is all the lower file system can use.  A
+ * u2fs source cannot be passed on, as the lower file system does not know
+ * its descriptor.
+ */
+long u2fs_ioctl_clone(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct inode *inode = file->f_path.dentry->d_inode;
+	struct u2fs_copy_range __user *uargs = (void __user *)arg;
+	struct file *lower_file, *src_file, *src;
+	const struct file_operations *fop;
+	__s64 fd;
+	long err;
+
+	lower_file = wrapfs_lower_file(file);
+	if (!lower_file)
+		return -EPERM;
+	if (!lower_file->f_op || !lower_file->f_op->unlocked_ioctl)
+		return -EOPNOTSUPP;
+	if (cmd == U2FS_IOC_CLONE)
+		fd = (int)arg;
+	else if (get_user(fd, &uargs->src_fd))
+		return -EFAULT;
+
+	src_file = fget(fd);
+	if (!src_file)
+		return -EBADF;
+	src = src_file;
+	fop = src_file->f_op;
+	if (fop == &wrapfs_main_fops || fop == &u2fs_pc_fops) {
+		src = wrapfs_lower_file(src_file);
+		if (!src)
+			src = wrapfs_lower_file_right(src_file);
+	}
+	if (!src || src->f_path.dentry->d_sb !=
+	    lower_file->f_path.dentry->d_sb)
+		err = -EXDEV;
+	else if (src != src_file)
+		err = -EOPNOTSUPP;
+	else
+		err = 0;
+	fput(src_file);
+	if (err)
+		return err;
+
+	/* a lazy fill must not overwrite the cloned range later */
+	err = u2fs_lazy_finish(file->f_path.dentry);
+	if (err)
+		return err;
+
+	mutex_lock(&inode->i_mutex);
+	if (u2fs_pagecache(inode))
+		filemap_write_and_wait(inode->i_mapping);
+	err = lower_file->f_op->unlocked_ioctl(lower_file, cmd, arg);
+	/* our pages of the destination are stale now */
+	if (u2fs_pagecache(inode))
+		invalidate_inode_pages2(inode->i_mapping);
+	u2fs_copy_inode_size(inode, lower_file->f_path.dentry->d_inode);
+	fsstack_copy_attr_times(inode, lower_file->f_path.dentry->d_inode);
+	mutex_unlock(&inode->i_mutex);
+	return err;
+}
+
+/* the u2fs file open as @fd, with a reference, to copy from */
+static struct file *u2fs_fget_src(int fd)
+{
+	struct file *file;
+	const struct file_operations *fop;
+	int err;
+
+	file = fget(fd);
+	if (!file)
+		return ERR_PTR(-EBADF);
+	fop = file->f_op;
+	if (fop != &wrapfs_main_fops && fop != &u2fs_pc_fops) {
+		fput(file);
+		return ERR_PTR(-EXDEV);
+	}
+	if (!(file->f_mode & FMODE_READ)) {
+		fput(file);
+		return ERR_PTR(-EBADF);
+	}
+	/* a lazy copy-up only has part of its data in the left branch */
+	err = u2fs_lazy_finish(file->f_path.dentry);
+	if (err) {
+		fput(file);
+		return ERR_PTR(err);
+	}
+
+	/* page cached files may not have written their data back yet */
+	if (u2fs_pagecache(file->f_path.dentry->d_inode))
+		filemap_write_and_wait(file->f_mapping);
+	return file;
+}
+
+/*
+ * U2FS_IOC_COPY_RANGE copies in the kernel and returns the number of
+ * bytes copied.  The source is another u2fs file, from either branch; the
+ * destination, @file, must be in the left branch.  Both ranges are
+ * checked like those of a read and a write, and the destination is
+ * written under its i_mutex, like a write.
+ */
+long u2fs_ioctl_copy(struct file *file, unsigned long arg)
+{
+	struct inode *inode = file->f_path.dentry->d_inode;
+	struct file *lower_file, *src_file, *src;
+	struct u2fs_copy_range args;
+	loff_t src_off, dst_off, len;
+	long err;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	if (!(file->f_mode & FMODE_WRITE) || (file->f_flags & O_APPEND))
+		return -EBADF;
+	lower_file = wrapfs_lower_file(file);
+	if (!lower_file)
+		return -EPERM;
+	err = u2fs_lazy_finish(file->f_path.dentry);
+	if (err)
+		return err;
+
+	if (copy_from_user(&args, (void __user *)arg, sizeof(args)))
+		return -EFAULT;
+	src_off = args.src_offset;
+	dst_off = args.dest_offset;
+	if (src_off < 0 || dst_off < 0 || (s64)args.src_length < 0)
+		return -EINVAL;
+
+	src_file = u2fs_fget_src(args.src_fd);
+	if (IS_ERR(src_file))
+		return PTR_ERR(src_file);
+	src = wrapfs_lower_file(src_file);
+	if (!src)
+		src = wrapfs_lower_file_right(src_file);
+
+	len = args.src_length;
+	if (!len)
+		len = max_t(loff_t, i_size_read(src->f_path.dentry->d_inode) -
+			    src_off, 0);
+	/* this also caps the count so that it fits our return value */
+	err = rw_verify_area(READ, src_file, &src_off,
+			     min_t(loff_t, len, MAX_RW_COUNT));
+	if (err < 0)
+		goto out_fput;
+	len = err;
+	err = rw_verify_area(WRITE, file, &dst_off, len);
+	if (err < 0)
+		goto out_fput;
+
+	/* a copy onto itself would read what it has just written */
+	if (src->f_path.dentry->d_inode ==
+	    lower_file->f_path.dentry->d_inode &&
+	    src_off < dst_off + len && dst_off < src_off + len) {
+		err = -EINVAL;
+		goto out_fput;
+	}
+
+	mutex_lock(&inode->i_mutex);
+	err = file_remove_suid(file);
+	if (err)
+		goto out_unlock;
+	if (u2fs_pagecache(inode))
+		filemap_write_and_wait(inode->i_mapping);
+
+	len = u2fs_copy_lower(lower_file, dst_off, src, src_off, len);
+	err = len;
+
+	/* our pages of the destination are stale now */
+	if (u2fs_pagecache(inode))
+		invalidate_inode_pages2(inode->i_mapping);
+	u2fs_copy_inode_size(inode, lower_file->f_path.dentry->d_inode);
+	fsstack_copy_attr_times(inode, lower_file->f_path.dentry->d_inode);
+out_unlock:
+	mutex_unlock(&inode->i_mutex);
+out_fput:
+	fput(src_file);
+	return err;
+}
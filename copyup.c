@@ -0,0 +1,802 @@
+/*
+ * Copyright (c) 1998-2011 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2011 Stony Brook University
+ * Copyright (c) 2003-2011 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "wrapfs.h"
+
+/*
+ * Create the left branch counterpart of the directory @dentry, whose
+ * parent @parent already exists in the left branch.  The new directory
+ * gets the mode and ownership of the right branch directory.
+ */
+static int __u2fs_copyup_dir(struct dentry *parent, struct dentry *dentry)
+{
+	struct path lower_parent_path, lower_path, right_path;
+	struct dentry *lower_dir_dentry;
+	struct dentry *lower_dentry;
+	struct inode *right_inode, *lower_inode;
+	struct iattr ia;
+	int mode = S_IRWXU;
+	int err = 0;
+
+	wrapfs_get_lower_path(parent, &lower_parent_path);
+	wrapfs_get_lower_path_right(dentry, &right_path);
+	right_inode = right_path.dentry ? right_path.dentry->d_inode : NULL;
+	if (right_inode)
+		mode = right_inode->i_mode & S_IALLUGO;
+
+	lower_dir_dentry = lower_parent_path.dentry;
+	mutex_lock_nested(&lower_dir_dentry->d_inode->i_mutex, I_MUTEX_PARENT);
+	lower_dentry = lookup_one_len(dentry->d_name.name, lower_dir_dentry,
+				      dentry->d_name.len);
+	if (IS_ERR(lower_dentry)) {
+		err = PTR_ERR(lower_dentry);
+		mutex_unlock(&lower_dir_dentry->d_inode->i_mutex);
+		goto out;
+	}
+	if (!lower_dentry->d_inode) {
+		err = mnt_want_write(lower_parent_path.mnt);
+		if (!err) {
+			err = vfs_mkdir(lower_dir_dentry->d_inode, lower_dentry,
+					mode);
+			mnt_drop_write(lower_parent_path.mnt);
+		}
+	}
+	mutex_unlock(&lower_dir_dentry->d_inode->i_mutex);
+	if (err)
+		goto out_dput;
+	if (!S_ISDIR(lower_dentry->d_inode->i_mode)) {
+		err = -ENOTDIR;
+		goto out_dput;
+	}
+
+	/* ownership is best effort: only a privileged caller may chown */
+	if (right_inode) {
+		ia.ia_valid = ATTR_UID | ATTR_GID;
+		ia.ia_uid = right_inode->i_uid;
+		ia.ia_gid = right_inode->i_gid;
+		if (!mnt_want_write(lower_parent_path.mnt)) {
+			mutex_lock(&lower_dentry->d_inode->i_mutex);
+			notify_change(lower_dentry, &ia);
+			mutex_unlock(&lower_dentry->d_inode->i_mutex);
+			mnt_drop_write(lower_parent_path.mnt);
+		}
+	}
+
+	/* publish the new lower directory, unless someone beat us to it */
+	lower_path.dentry = lower_dentry;
+	lower_path.mnt = mntget(lower_parent_path.mnt);
+	lower_inode = NULL;
+	spin_lock(&WRAPFS_D(dentry)->lock);
+	if (!WRAPFS_D(dentry)->lower_path.dentry) {
+		__wrapfs_publish_lower_path(dentry,
+					    &WRAPFS_D(dentry)->lower_path,
+					    &lower_path);
+		if (dentry->d_inode && !wrapfs_lower_inode(dentry->d_inode)) {
+			lower_inode = lower_dentry->d_inode;
+			wrapfs_set_lower_inode(dentry->d_inode,
+					       igrab(lower_inode), 0);
+		}
+		lower_dentry = NULL;
+	}
+	WRAPFS_D(dentry)->branches |= U2FS_BR_LEFT;
+	spin_unlock(&WRAPFS_D(dentry)->lock);
+	if (lower_dentry)
+		mntput(lower_path.mnt);
+
+	/* the inode is now known by its left lower inode, see u2fs_iget */
+	if (lower_inode) {
+		remove_inode_hash(dentry->d_inode);
+		__insert_inode_hash(dentry->d_inode, lower_inode->i_ino);
+	}
+
+out_dput:
+	dput(lower_dentry);
+out:
+	wrapfs_put_lower_path(dentry, &right_path);
+	wrapfs_put_lower_path(parent, &lower_parent_path);
+	return err;
+}
+
+/*
+ * Make sure the directory @dentry and all of its ancestors exist in the
+ * left branch.  Missing directories are created top-down; on success the
+ * left lower path of every directory on the chain is set.
+ */
+int u2fs_copyup_parents(struct dentry *dentry)
+{
+	struct dentry *d, *parent;
+	int err = 0;
+
+	while (!err && !u2fs_has_branch(dentry, 0)) {
+		/* find the topmost ancestor missing from the left branch */
+		d = dget(dentry);
+		parent = dget_parent(d);
+		while (!u2fs_has_branch(parent, 0)) {
+			dput(d);
+			d = parent;
+			parent = dget_parent(d);
+		}
+		err = __u2fs_copyup_dir(parent, d);
+		dput(parent);
+		dput(d);
+	}
+	return err;
+}
+
+/*
+ * Give the negative dentry @dentry a left branch lower dentry on which a
+ * new object can be created, copying its parent directory chain up first
+ * if the parent only exists in the right branch.  The caller holds the
+ * parent's i_mutex.
+ */
+int u2fs_copyup_negative(struct dentry *dentry)
+{
+	struct dentry *parent = dentry->d_parent;
+	struct path lower_parent_path, lower_path;
+	struct dentry *lower_dentry;
+	int err;
+
+	if (wrapfs_get_lower_dentry_idx(dentry, 0))
+		return u2fs_wh_convert(parent);
+
+	err = u2fs_copyup_parents(parent);
+	if (!err)
+		err = u2fs_wh_convert(parent);
+	if (err)
+		return err;
+
+	wrapfs_get_lower_path(parent, &lower_parent_path);
+	lower_dentry = lookup_lck_len((const char *)dentry->d_name.name,
+				      lower_parent_path.dentry,
+				      dentry->d_name.len);
+	if (IS_ERR(lower_dentry)) {
+		err = PTR_ERR(lower_dentry);
+		goto out;
+	}
+	lower_path.dentry = lower_dentry;
+	lower_path.mnt = mntget(lower_parent_path.mnt);
+	wrapfs_set_lower_path(dentry, &lower_path);
+out:
+	wrapfs_put_lower_path(parent, &lower_parent_path);
+	return err;
+}
+
+/* remove the unfinished copy @tmp_dentry from @lower_dir_dentry */
+static void u2fs_copyup_abort(struct dentry *lower_dir_dentry,
+			      struct dentry *tmp_dentry)
+{
+	mutex_lock_nested(&lower_dir_dentry->d_inode->i_mutex, I_MUTEX_PARENT);
+	if (tmp_dentry->d_parent == lower_dir_dentry && tmp_dentry->d_inode)
+		vfs_unlink(lower_dir_dentry->d_inode, tmp_dentry);
+	mutex_unlock(&lower_dir_dentry->d_inode->i_mutex);
+}
+
+/*
+ * Create @tmp_dentry in @lower_dir_dentry as an object of the type of
+ * @right_dentry.  Regular files get their data afterwards.
+ */
+static int u2fs_copyup_create(struct dentry *lower_dir_dentry,
+			      struct dentry *tmp_dentry,
+			      struct dentry *right_dentry)
+{
+	struct inode *right_inode = right_dentry->d_inode;
+	struct inode *dir = lower_dir_dentry->d_inode;
+	mm_segment_t old_fs;
+	char *target;
+	int err;
+
+	switch (right_inode->i_mode & S_IFMT) {
+	case S_IFREG:
+		return vfs_create(dir, tmp_dentry, S_IRUSR | S_IWUSR, NULL);
+	case S_IFLNK:
+		if (!right_inode->i_op->readlink)
+			return -EPERM;
+		target = (char *)__get_free_page(GFP_KERNEL);
+		if (!target)
+			return -ENOMEM;
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		err = right_inode->i_op->readlink(right_dentry,
+						  (char __user *)target,
+						  PAGE_SIZE - 1);
+		set_fs(old_fs);
+		if (err >= 0) {
+			target[err] = '\0';
+			err = vfs_symlink(dir, tmp_dentry, target);
+		}
+		free_page((unsigned long)target);
+		return err;
+	case S_IFCHR:
+	case S_IFBLK:
+	case S_IFIFO:
+	case S_IFSOCK:
+		return vfs_mknod(dir, tmp_dentry, right_inode->i_mode,
+				 right_inode->i_rdev);
+	}
+	return -EPERM;
+}
+
+/* give the new object @tmp_dentry the attributes of @right_inode */
+static int u2fs_copyup_attrs(struct dentry *tmp_dentry,
+			     struct inode *right_inode)
+{
+	struct iattr ia;
+	int err;
+
+	/* ownership is best effort: only a privileged mounter may chown */
+	mutex_lock(&tmp_dentry->d_inode->i_mutex);
+	ia.ia_valid = ATTR_UID | ATTR_GID;
+	ia.ia_uid = right_inode->i_uid;
+	ia.ia_gid = right_inode->i_gid;
+	notify_change(tmp_dentry, &ia);
+
+	/* times last, as writing the data has just set them */
+	ia.ia_valid = ATTR_ATIME | ATTR_MTIME | ATTR_ATIME_SET | ATTR_MTIME_SET;
+	if (!S_ISLNK(right_inode->i_mode))
+		ia.ia_valid |= ATTR_MODE;
+	ia.ia_mode = right_inode->i_mode;
+	ia.ia_atime = right_inode->i_atime;
+	ia.ia_mtime = right_inode->i_mtime;
+	err = notify_change(tmp_dentry, &ia);
+	mutex_unlock(&tmp_dentry->d_inode->i_mutex);
+	return err;
+}
+
+/*
+ * Copy-ups build their copy in the work area, a directory of u2fs' own in
+ * the left branch root, under the number of the right branch inode.  Data
+ * is copied in steps of U2FS_CU_STEP bytes; after each one the copy is
+ * synced and a journal in an xattr of it records how far it got.  A copy
+ * interrupted by an unmount or a crash is continued from there the next
+ * time the file is copied up, as long as the right branch file did not
+ * change in between.  u2fs_copyup_recover drops the copies that cannot be
+ * continued any more when the branches are mounted again.
+ */
+#define U2FS_CU_STEP		(64 << 20)
+#define U2FS_CU_JOURNAL_MAGIC	0x75326a31	/* "u2j1" */
+
+struct u2fs_cu_journal {
+	__le32 magic;
+	__le32 mtime_nsec;
+	__le64 ino;		/* of the right branch file, */
+	__le64 size;		/* its size */
+	__le64 mtime_sec;	/* and mtime, when the copy started */
+	__le64 done;		/* bytes copied and synced */
+	char path[0];		/* of the file from the branch root */
+};
+
+/* the work area of @sb, created if @create; NULL if there is none */
+struct dentry *u2fs_workdir(struct super_block *sb, int create)
+{
+	struct dentry *root = WRAPFS_SB(sb)->lower_root.dentry;
+	struct dentry *work;
+	int err = 0;
+
+	mutex_lock_nested(&root->d_inode->i_mutex, I_MUTEX_PARENT);
+	work = lookup_one_len(U2FS_WHWORK, root, U2FS_WHWORKLEN);
+	if (!IS_ERR(work) && !work->d_inode) {
+		if (create)
+			err = vfs_mkdir(root->d_inode, work, S_IRWXU);
+		if (err || !create) {
+			dput(work);
+			work = err ? ERR_PTR(err) : NULL;
+		}
+	}
+	mutex_unlock(&root->d_inode->i_mutex);
+
+	if (!IS_ERR_OR_NULL(work) && !S_ISDIR(work->d_inode->i_mode)) {
+		dput(work);
+		work = ERR_PTR(-ENOTDIR);
+	}
+	return work;
+}
+
+/* a journal for copying up @dentry, @right_inode in the right branch */
+static struct u2fs_cu_journal *u2fs_cu_journal_new(struct dentry *dentry,
+						   struct inode *right_inode,
+						   size_t *lenp)
+{
+	struct u2fs_cu_journal *jnl;
+	char *buf, *path;
+	size_t len;
+
+	buf = __getname();
+	if (!buf)
+		return ERR_PTR(-ENOMEM);
+	path = dentry_path_raw(dentry, buf, PATH_MAX);
+	if (IS_ERR(path)) {
+		__putname(buf);
+		return ERR_CAST(path);
+	}
+
+	len = sizeof(*jnl) + strlen(path) + 1;
+	jnl = kmalloc(len, GFP_KERNEL);
+	if (jnl) {
+		jnl->magic = cpu_to_le32(U2FS_CU_JOURNAL_MAGIC);
+		jnl->mtime_nsec = cpu_to_le32(right_inode->i_mtime.tv_nsec);
+		jnl->ino = cpu_to_le64(right_inode->i_ino);
+		jnl->size = cpu_to_le64(i_size_read(right_inode));
+		jnl->mtime_sec = cpu_to_le64(right_inode->i_mtime.tv_sec);
+		jnl->done = 0;
+		strcpy(jnl->path, path);
+		*lenp = len;
+	}
+	__putname(buf);
+	return jnl ? jnl : ERR_PTR(-ENOMEM);
+}
+
+/*
+ * How much of the leftover copy @tmp_dentry can be kept: what its journal
+ * says, if the journal was written for the copy-up described by @jnl.
+ */
+static loff_t u2fs_cu_journal_check(struct dentry *tmp_dentry,
+				    struct u2fs_cu_journal *jnl, size_t len)
+{
+	struct u2fs_cu_journal *old;
+	loff_t done = 0;
+
+	if (!S_ISREG(tmp_dentry->d_inode->i_mode))
+		return 0;
+	old = kmalloc(len, GFP_KERNEL);
+	if (!old)
+		return 0;
+	if (vfs_getxattr(tmp_dentry, U2FS_CU_JOURNAL_XATTR, old, len) == len) {
+		done = le64_to_cpu(old->done);
+		old->done = jnl->done;
+		if (memcmp(old, jnl, len) || done > le64_to_cpu(jnl->size) ||
+		    done > i_size_read(tmp_dentry->d_inode))
+			done = 0;
+	}
+	kfree(old);
+	return done;
+}
+
+static int u2fs_cu_journal_store(struct dentry *tmp_dentry,
+				 struct u2fs_cu_journal *jnl, size_t len,
+				 loff_t done)
+{
+	jnl->done = cpu_to_le64(done);
+	return vfs_setxattr(tmp_dentry, U2FS_CU_JOURNAL_XATTR, jnl, len, 0);
+}
+
+/*
+ * Copy the first @len bytes of the right branch file @right_path to the
+ * new file @tmp_path, from where @jnl says an earlier attempt got.  With
+ * @meta, only the attributes change: the data stays in the right branch
+ * until the first write, see lazy.c.
+ */
+static int u2fs_copyup_data(struct super_block *sb, struct path *tmp_path,
+			    struct path *right_path, loff_t len, int meta,
+			    struct u2fs_cu_journal *jnl, size_t jlen)
+{
+	struct inode *right_inode = right_path->dentry->d_inode;
+	const struct cred *cred = current_cred();
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct file *src, *dst;
+	struct iattr ia;
+	loff_t pos, copied;
+	int journal = 1;
+	int err = 0;
+
+	if (len > i_size_read(right_inode))
+		len = i_size_read(right_inode);
+	pos = le64_to_cpu(jnl->done);
+
+	/* large files get their data later too; page cached ones cannot */
+	if (len && !pos && len == i_size_read(right_inode) &&
+	    !(sbi->flags & U2FS_MNT_PAGECACHE) &&
+	    (meta || (sbi->lazy_min && len >= sbi->lazy_min))) {
+		err = u2fs_lazy_create(sb, tmp_path, len);
+		if (!err)
+			return 0;
+		/* the lower file system may not have xattrs */
+		if (err != -EOPNOTSUPP)
+			return err;
+		err = 0;
+	}
+
+	path_get(right_path);
+	src = dentry_open(right_path->dentry, right_path->mnt,
+			  O_RDONLY | O_LARGEFILE, cred);
+	if (IS_ERR(src))
+		return PTR_ERR(src);
+	path_get(tmp_path);
+	dst = dentry_open(tmp_path->dentry, tmp_path->mnt,
+			  O_WRONLY | O_LARGEFILE, cred);
+	if (IS_ERR(dst)) {
+		fput(src);
+		return PTR_ERR(dst);
+	}
+
+	/* the copy starts out as one hole, which keeps those of the source */
+	if (!pos && len) {
+		ia.ia_valid = ATTR_SIZE;
+		ia.ia_size = len;
+		mutex_lock(&tmp_path->dentry->d_inode->i_mutex);
+		err = notify_change(tmp_path->dentry, &ia);
+		mutex_unlock(&tmp_path->dentry->d_inode->i_mutex);
+	}
+
+	/* clone, splice, or read and write, whatever the branches allow */
+	while (!err && pos < len) {
+		copied = u2fs_copy_sparse(dst, src, pos,
+					  min_t(loff_t, len - pos,
+						U2FS_CU_STEP));
+		if (copied <= 0) {
+			err = copied < 0 ? copied : -EIO;
+			break;
+		}
+		u2fs_cuq_account(sb, copied);
+		pos += copied;
+		if (pos == len)
+			break;
+
+		/* the journal may lag behind the data on disk, never lead */
+		if (journal && !vfs_fsync(dst, 0))
+			journal = !u2fs_cu_journal_store(tmp_path->dentry,
+							 jnl, jlen, pos);
+		if (test_bit(U2FS_SB_DYING, &sbi->state)) {
+			err = -EINTR;
+			break;
+		}
+	}
+	fput(dst);
+	fput(src);
+	return err;
+}
+
+/*
+ * Copy the right branch object @dentry up to the left branch.  Regular
+ * files take the first @len bytes of their data along, or with @meta none
+ * until they are written to.  The copy is built in the work area and
+ * renamed into place once complete, so the left branch never shows a
+ * partial file under the real name.  All of it is done as the mounter.
+ * The caller holds the i_mutex of @dentry's inode, which keeps concurrent
+ * copy-ups of it out.
+ */
+int u2fs_copyup_file(struct dentry *dentry, loff_t len, int meta)
+{
+	struct inode *inode = dentry->d_inode;
+	struct inode *old_lower_inode;
+	struct dentry *parent, *lower_dir_dentry, *tmp_dentry, *lower_dentry;
+	struct dentry *work, *trap;
+	struct path lower_parent_path, right_path, tmp_path, old_path;
+	struct u2fs_cu_journal *jnl = NULL;
+	const struct cred *old_cred;
+	char name[2 * sizeof(unsigned long) + 1];
+	size_t jlen = 0;
+	int err;
+
+	if (u2fs_has_branch(dentry, 0))
+		return 0;
+	/* a left branch object whose bit is not set needs no copy-up */
+	lower_dentry = wrapfs_get_lower_dentry_idx(dentry, 0);
+	if (lower_dentry && lower_dentry->d_inode) {
+		u2fs_set_branches(dentry, U2FS_BR_LEFT);
+		return 0;
+	}
+	if (S_ISDIR(inode->i_mode))
+		return -EISDIR;
+	/*
+	 * Another name of a hard linked right branch file was copied up
+	 * already, and the inode the two names shared went with it.  Drop
+	 * this name so that its next lookup gets an inode of its own; open
+	 * retries the lookup on -ESTALE.
+	 */
+	if (wrapfs_lower_inode(inode)) {
+		d_drop(dentry);
+		return -ESTALE;
+	}
+
+	old_cred = override_creds(WRAPFS_SB(dentry->d_sb)->cred);
+	parent = dget_parent(dentry);
+	err = u2fs_copyup_parents(parent);
+	if (err)
+		goto out_dput;
+
+	wrapfs_get_lower_path_right(dentry, &right_path);
+	wrapfs_get_lower_path(parent, &lower_parent_path);
+	lower_dir_dentry = lower_parent_path.dentry;
+	if (!right_path.dentry || !right_path.dentry->d_inode) {
+		err = -ENOENT;
+		goto out_put;
+	}
+	err = mnt_want_write(lower_parent_path.mnt);
+	if (err)
+		goto out_put;
+
+	work = u2fs_workdir(dentry->d_sb, 1);
+	if (IS_ERR(work)) {
+		err = PTR_ERR(work);
+		goto out_drop;
+	}
+	if (S_ISREG(inode->i_mode)) {
+		jnl = u2fs_cu_journal_new(dentry, right_path.dentry->d_inode,
+					  &jlen);
+		if (IS_ERR(jnl)) {
+			err = PTR_ERR(jnl);
+			jnl = NULL;
+			goto out_work;
+		}
+	}
+
+	/* a leftover from an interrupted copy-up is continued or replaced */
+	snprintf(name, sizeof(name), "%lx", right_path.dentry->d_inode->i_ino);
+	mutex_lock_nested(&work->d_inode->i_mutex, I_MUTEX_PARENT);
+	tmp_dentry = lookup_one_len(name, work, strlen(name));
+	if (!IS_ERR(tmp_dentry) && tmp_dentry->d_inode) {
+		if (jnl && len >= le64_to_cpu(jnl->size))
+			jnl->done = cpu_to_le64(u2fs_cu_journal_check(tmp_dentry,
+								      jnl,
+								      jlen));
+		if (!jnl || !jnl->done) {
+			err = vfs_unlink(work->d_inode, tmp_dentry);
+			dput(tmp_dentry);
+			tmp_dentry = err ? ERR_PTR(err) :
+				lookup_one_len(name, work, strlen(name));
+		}
+	}
+	if (IS_ERR(tmp_dentry)) {
+		err = PTR_ERR(tmp_dentry);
+		mutex_unlock(&work->d_inode->i_mutex);
+		goto out_work;
+	}
+	if (!tmp_dentry->d_inode)
+		err = u2fs_copyup_create(work, tmp_dentry, right_path.dentry);
+	mutex_unlock(&work->d_inode->i_mutex);
+	if (err)
+		goto out_tmp;
+
+	tmp_path.dentry = tmp_dentry;
+	tmp_path.mnt = lower_parent_path.mnt;
+	if (jnl) {
+		err = u2fs_copyup_data(dentry->d_sb, &tmp_path, &right_path,
+				       len, meta, jnl, jlen);
+		if (!err)
+			vfs_removexattr(tmp_dentry, U2FS_CU_JOURNAL_XATTR);
+	}
+	if (!err)
+		err = u2fs_copyup_attrs(tmp_dentry, right_path.dentry->d_inode);
+	if (err)
+		goto out_abort;
+
+	/* publish the copy under the real name */
+	trap = lock_rename(work, lower_dir_dentry);
+	lower_dentry = lookup_one_len(dentry->d_name.name, lower_dir_dentry,
+				      dentry->d_name.len);
+	if (IS_ERR(lower_dentry))
+		err = PTR_ERR(lower_dentry);
+	else {
+		if (lower_dentry->d_inode)
+			err = -EEXIST;
+		else if (lower_dentry == trap)
+			err = -EINVAL;
+		else
+			err = vfs_rename(work->d_inode, tmp_dentry,
+					 lower_dir_dentry->d_inode,
+					 lower_dentry);
+		dput(lower_dentry);
+	}
+	unlock_rename(work, lower_dir_dentry);
+	if (err)
+		goto out_abort;
+
+	/* vfs_rename moved tmp_dentry to the real name */
+	tmp_path.mnt = mntget(lower_parent_path.mnt);
+	spin_lock(&WRAPFS_D(dentry)->lock);
+	old_path = WRAPFS_D(dentry)->lower_path;
+	__wrapfs_publish_lower_path(dentry, &WRAPFS_D(dentry)->lower_path,
+				    &tmp_path);
+	WRAPFS_D(dentry)->branches |= U2FS_BR_LEFT;
+	spin_unlock(&WRAPFS_D(dentry)->lock);
+	tmp_dentry = NULL;
+	/* lockless readers may have just copied it, see wrapfs_get_lower_path */
+	if (old_path.dentry)
+		u2fs_path_put_rcu(&old_path);
+
+	/* the inode is now known by its left lower inode, see u2fs_iget */
+	lower_dentry = WRAPFS_D(dentry)->lower_path.dentry;
+	remove_inode_hash(inode);
+	old_lower_inode = wrapfs_lower_inode(inode);
+	wrapfs_set_lower_inode(inode, igrab(lower_dentry->d_inode), 0);
+	iput(old_lower_inode);
+	__insert_inode_hash(inode, lower_dentry->d_inode->i_ino);
+	fsstack_copy_attr_all(inode, lower_dentry->d_inode);
+	u2fs_copy_inode_size(inode, lower_dentry->d_inode);
+	fsstack_copy_attr_times(parent->d_inode, lower_dir_dentry->d_inode);
+	goto out_work;
+
+out_abort:
+	/* an interrupted copy keeps what it got done for the next attempt */
+	if (err != -EINTR || !jnl || !jnl->done)
+		u2fs_copyup_abort(work, tmp_dentry);
+out_tmp:
+	dput(tmp_dentry);
+out_work:
+	kfree(jnl);
+	dput(work);
+out_drop:
+	mnt_drop_write(lower_parent_path.mnt);
+out_put:
+	wrapfs_put_lower_path(parent, &lower_parent_path);
+	wrapfs_put_lower_path(dentry, &right_path);
+out_dput:
+	dput(parent);
+	revert_creds(old_cred);
+	return err;
+}
+
+/* state passed to u2fs_cu_filldir while reading the work area */
+struct u2fs_cu_readdir {
+	struct list_head names;
+	int filldir_called;
+	int err;
+};
+
+struct u2fs_cu_name {
+	struct list_head list;
+	int len;
+	char name[0];
+};
+
+static int u2fs_cu_filldir(void *dirent, const char *name, int namelen,
+			   loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct u2fs_cu_readdir *buf = dirent;
+	struct u2fs_cu_name *ent;
+
+	buf->filldir_called++;
+	if ((namelen == 1 && name[0] == '.') ||
+	    (namelen == 2 && name[0] == '.' && name[1] == '.'))
+		return 0;
+
+	ent = kmalloc(sizeof(*ent) + namelen + 1, GFP_KERNEL);
+	if (!ent) {
+		buf->err = -ENOMEM;
+		return buf->err;
+	}
+	ent->len = namelen;
+	memcpy(ent->name, name, namelen);
+	ent->name[namelen] = '\0';
+	list_add_tail(&ent->list, &buf->names);
+	return 0;
+}
+
+/*
+ * Can the leftover copy @tmp_dentry still be continued?  Only if it has a
+ * journal, the right branch file it was copied from is unchanged, and
+ * the left branch has neither a file nor a whiteout by that name now.
+ */
+static int u2fs_cu_resumable(struct super_block *sb, struct dentry *tmp_dentry)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct u2fs_cu_journal *jnl;
+	struct inode *right_inode;
+	struct path path;
+	char *base, *whpath;
+	ssize_t len;
+	int ok = 0;
+
+	if (!S_ISREG(tmp_dentry->d_inode->i_mode))
+		return 0;
+	len = vfs_getxattr(tmp_dentry, U2FS_CU_JOURNAL_XATTR, NULL, 0);
+	if (len <= (ssize_t)sizeof(*jnl) + 1 ||
+	    len > (ssize_t)sizeof(*jnl) + PATH_MAX)
+		return 0;
+	jnl = kmalloc(len, GFP_KERNEL);
+	if (!jnl)
+		return 0;
+	if (vfs_getxattr(tmp_dentry, U2FS_CU_JOURNAL_XATTR, jnl, len) != len ||
+	    le32_to_cpu(jnl->magic) != U2FS_CU_JOURNAL_MAGIC ||
+	    ((char *)jnl)[len - 1] != '\0' || jnl->path[0] != '/')
+		goto out;
+
+	if (vfs_path_lookup(sbi->lower_root_right.dentry,
+			    sbi->lower_root_right.mnt, jnl->path, 0, &path))
+		goto out;
+	right_inode = path.dentry->d_inode;
+	ok = S_ISREG(right_inode->i_mode) &&
+		right_inode->i_ino == le64_to_cpu(jnl->ino) &&
+		i_size_read(right_inode) == le64_to_cpu(jnl->size) &&
+		right_inode->i_mtime.tv_sec == le64_to_cpu(jnl->mtime_sec) &&
+		right_inode->i_mtime.tv_nsec == le32_to_cpu(jnl->mtime_nsec);
+	path_put(&path);
+
+	if (ok && !vfs_path_lookup(sbi->lower_root.dentry, sbi->lower_root.mnt,
+				   jnl->path, 0, &path)) {
+		path_put(&path);
+		ok = 0;
+	}
+	if (ok) {
+		base = strrchr(jnl->path, '/') + 1;
+		whpath = kasprintf(GFP_KERNEL, "%.*s" U2FS_WHPFX "%s",
+				   (int)(base - jnl->path), jnl->path, base);
+		if (!whpath)
+			ok = 0;
+		else if (!vfs_path_lookup(sbi->lower_root.dentry,
+					  sbi->lower_root.mnt, whpath, 0,
+					  &path)) {
+			path_put(&path);
+			ok = 0;
+		}
+		kfree(whpath);
+	}
+out:
+	kfree(jnl);
+	return ok;
+}
+
+/*
+ * Called at mount: keep the copies in the work area that can be continued
+ * and roll back the rest, left behind by an earlier mount that went away
+ * in the middle of copying them up.  Removed directories it left there
+ * are finished off.
+ */
+void u2fs_copyup_recover(struct super_block *sb)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct u2fs_cu_readdir buf;
+	struct u2fs_cu_name *ent, *n;
+	struct dentry *work, *tmp_dentry;
+	struct file *dir;
+	int kept = 0, dropped = 0;
+	int err;
+
+	work = u2fs_workdir(sb, 0);
+	if (IS_ERR_OR_NULL(work))
+		return;
+	if (mnt_want_write(sbi->lower_root.mnt)) {
+		dput(work);
+		return;
+	}
+
+	INIT_LIST_HEAD(&buf.names);
+	buf.err = 0;
+	mntget(sbi->lower_root.mnt);
+	dir = dentry_open(dget(work), sbi->lower_root.mnt,
+			  O_RDONLY | O_DIRECTORY, current_cred());
+	if (IS_ERR(dir))
+		goto out;
+	do {
+		buf.filldir_called = 0;
+		err = vfs_readdir(dir, u2fs_cu_filldir, &buf);
+		if (buf.err)
+			err = buf.err;
+	} while (err >= 0 && buf.filldir_called);
+	fput(dir);
+
+	list_for_each_entry(ent, &buf.names, list) {
+		mutex_lock(&work->d_inode->i_mutex);
+		tmp_dentry = lookup_one_len(ent->name, work, ent->len);
+		mutex_unlock(&work->d_inode->i_mutex);
+		if (IS_ERR(tmp_dentry))
+			continue;
+		/* a directory whose rmdir was interrupted, see u2fs_wh_rmdir */
+		if (tmp_dentry->d_inode && S_ISDIR(tmp_dentry->d_inode->i_mode))
+			u2fs_wh_clean(work, tmp_dentry, sbi->lower_root.mnt);
+		else if (tmp_dentry->d_inode &&
+			 u2fs_cu_resumable(sb, tmp_dentry))
+			kept++;
+		else if (tmp_dentry->d_inode) {
+			u2fs_copyup_abort(work, tmp_dentry);
+			dropped++;
+		}
+		dput(tmp_dentry);
+	}
+	if (kept || dropped)
+		printk(KERN_INFO "u2fs: %d interrupted copy-ups to continue, "
+		       "%d rolled back\n", kept, dropped);
+out:
+	list_for_each_entry_safe(ent, n, &buf.names, list)
+		kfree(ent);
+	mnt_drop_write(sbi->lower_root.mnt);
+	dput(work);
+}
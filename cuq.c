@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 1998-2011 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2011 Stony Brook University
+ * Copyright (c) 2003-2011 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "wrapfs.h"
+
+/*
+ * The copy-up queue.  Copy-ups run in a pool of U2FS_CUQ_WORKERS workers
+ * per mount rather than in the context of whoever needs them, so a burst
+ * of openers does not start thousands of copies at once.  There is one
+ * request per inode at most: whoever asks for a copy-up of a file that
+ * already has one in flight waits for that one.  Requests somebody waits
+ * for (foreground) are started before those nobody does (speculative),
+ * and a speculative request that gets a waiter moves up.
+ */
+
+struct u2fs_cureq {
+	struct list_head list;		/* in a queue until started */
+	struct dentry *dentry;
+	int op;				/* U2FS_CU_COPYUP or U2FS_CU_FINISH */
+	int prio;
+	loff_t len;			/* of data to copy up */
+	int err;
+	atomic_t count;
+	struct completion done;
+};
+
+static struct workqueue_struct *u2fs_cuq_wq;
+
+static void u2fs_cureq_put(struct u2fs_cureq *req)
+{
+	if (!atomic_dec_and_test(&req->count))
+		return;
+	dput(req->dentry);
+	kfree(req);
+}
+
+/*
+ * Queue a request to do @op on @dentry, or join the one in flight for
+ * it.  Returns the request with a reference for the caller, or NULL for
+ * speculative requests of a mount going away.
+ */
+static struct u2fs_cureq *u2fs_cuq_submit(struct dentry *dentry, int op,
+					  loff_t len, int prio)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(dentry->d_sb);
+	struct wrapfs_inode_info *info = WRAPFS_I(dentry->d_inode);
+	struct u2fs_cuq *cuq = &sbi->cuq;
+	struct u2fs_cureq *req, *new;
+	int i;
+
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return ERR_PTR(-ENOMEM);
+
+	spin_lock(&cuq->lock);
+	if (prio == U2FS_CU_SPECULATIVE &&
+	    test_bit(U2FS_SB_DYING, &sbi->state)) {
+		spin_unlock(&cuq->lock);
+		kfree(new);
+		return NULL;
+	}
+
+	req = info->cureq;
+	if (req) {
+		if (prio > req->prio) {
+			if (!list_empty(&req->list)) {
+				list_move_tail(&req->list, &cuq->queue[prio]);
+				cuq->stats.queued[req->prio]--;
+				cuq->stats.queued[prio]++;
+			}
+			req->prio = prio;
+		}
+		atomic_inc(&req->count);
+		cuq->stats.shared++;
+		spin_unlock(&cuq->lock);
+		kfree(new);
+		return req;
+	}
+
+	req = new;
+	req->dentry = dget(dentry);
+	req->op = op;
+	req->prio = prio;
+	req->len = len;
+	atomic_set(&req->count, 2);	/* the queue's and the caller's */
+	init_completion(&req->done);
+	list_add_tail(&req->list, &cuq->queue[prio]);
+	info->cureq = req;
+	cuq->stats.queued[prio]++;
+	cuq->stats.requests++;
+
+	/* start an idle worker, if there is one */
+	i = find_first_zero_bit(&cuq->busy, U2FS_CUQ_WORKERS);
+	if (i < U2FS_CUQ_WORKERS)
+		__set_bit(i, &cuq->busy);
+	spin_unlock(&cuq->lock);
+
+	if (i < U2FS_CUQ_WORKERS)
+		queue_work(u2fs_cuq_wq, &cuq->worker[i].work);
+	return req;
+}
+
+static int u2fs_cureq_run(struct u2fs_cureq *req)
+{
+	struct dentry *dentry = req->dentry;
+	int err;
+
+	if (req->op == U2FS_CU_COPYUP) {
+		mutex_lock(&dentry->d_inode->i_mutex);
+		err = u2fs_copyup_file(dentry, req->len, 0);
+		mutex_unlock(&dentry->d_inode->i_mutex);
+	} else
+		err = u2fs_lazy_finish(dentry);
+
+	if (err && err != -EINTR)
+		printk(KERN_ERR "u2fs: copying up %s failed (%d)\n",
+		       dentry->d_name.name, err);
+	return err;
+}
+
+/* run requests, foreground ones first, until there are none left */
+static void u2fs_cuq_work_fn(struct work_struct *work)
+{
+	struct u2fs_cuq_worker *worker =
+		container_of(work, struct u2fs_cuq_worker, work);
+	struct u2fs_cuq *cuq = worker->cuq;
+	struct u2fs_cureq *req;
+	ktime_t start;
+	int prio;
+
+	for (;;) {
+		spin_lock(&cuq->lock);
+		req = NULL;
+		for (prio = U2FS_CU_NPRIO - 1; prio >= 0; prio--) {
+			if (list_empty(&cuq->queue[prio]))
+				continue;
+			req = list_first_entry(&cuq->queue[prio],
+					       struct u2fs_cureq, list);
+			list_del_init(&req->list);
+			cuq->stats.queued[prio]--;
+			break;
+		}
+		if (!req) {
+			/* under the lock, so no request is left behind */
+			__clear_bit(worker - cuq->worker, &cuq->busy);
+			spin_unlock(&cuq->lock);
+			return;
+		}
+		cuq->stats.active++;
+		spin_unlock(&cuq->lock);
+
+		start = ktime_get();
+		req->err = u2fs_cureq_run(req);
+
+		spin_lock(&cuq->lock);
+		cuq->stats.active--;
+		cuq->stats.busy_ns += ktime_to_ns(ktime_sub(ktime_get(),
+							    start));
+		if (req->err)
+			cuq->stats.failed++;
+		else
+			cuq->stats.done++;
+		WRAPFS_I(req->dentry->d_inode)->cureq = NULL;
+		spin_unlock(&cuq->lock);
+
+		complete_all(&req->done);
+		u2fs_cureq_put(req);
+		cond_resched();
+	}
+}
+
+/*
+ * Do @op on @dentry in the pool and wait for it.  @len is the length of
+ * data to copy up for U2FS_CU_COPYUP.  Both operations do nothing if
+ * they are not needed (any more), so a request that joined one for the
+ * other operation, or for another name of a hard linked file, can simply
+ * be queued again.
+ */
+int u2fs_cuq_run(struct dentry *dentry, int op, loff_t len)
+{
+	struct u2fs_cureq *req;
+	int err;
+
+	do {
+		req = u2fs_cuq_submit(dentry, op, len, U2FS_CU_FOREGROUND);
+		if (IS_ERR(req))
+			return PTR_ERR(req);
+		err = wait_for_completion_killable(&req->done);
+		if (!err)
+			err = req->err;
+		if (!err && (req->op != op || req->dentry != dentry))
+			err = -EAGAIN;
+		u2fs_cureq_put(req);
+	} while (err == -EAGAIN);
+	return err;
+}
+
+/* queue @op on @dentry for when the pool has nothing better to do */
+void u2fs_cuq_queue(struct dentry *dentry, int op)
+{
+	struct u2fs_cureq *req;
+
+	req = u2fs_cuq_submit(dentry, op, 0, U2FS_CU_SPECULATIVE);
+	if (!IS_ERR_OR_NULL(req))
+		u2fs_cureq_put(req);
+}
+
+/* count @bytes of data copied up on @sb */
+void u2fs_cuq_account(struct super_block *sb, loff_t bytes)
+{
+	struct u2fs_cuq *cuq = &WRAPFS_SB(sb)->cuq;
+
+	spin_lock(&cuq->lock);
+	cuq->stats.bytes += bytes;
+	spin_unlock(&cuq->lock);
+}
+
+/* U2FS_IOC_CU_STATS */
+long u2fs_cuq_stats(struct super_block *sb, void __user *arg)
+{
+	struct u2fs_cuq *cuq = &WRAPFS_SB(sb)->cuq;
+	struct u2fs_cu_stats stats;
+
+	spin_lock(&cuq->lock);
+	stats = cuq->stats;
+	spin_unlock(&cuq->lock);
+
+	if (copy_to_user(arg, &stats, sizeof(stats)))
+		return -EFAULT;
+	return 0;
+}
+
+void u2fs_cuq_start(struct super_block *sb)
+{
+	struct u2fs_cuq *cuq = &WRAPFS_SB(sb)->cuq;
+	int i;
+
+	spin_lock_init(&cuq->lock);
+	for (i = 0; i < U2FS_CU_NPRIO; i++)
+		INIT_LIST_HEAD(&cuq->queue[i]);
+	for (i = 0; i < U2FS_CUQ_WORKERS; i++) {
+		INIT_WORK(&cuq->worker[i].work, u2fs_cuq_work_fn);
+		cuq->worker[i].cuq = cuq;
+	}
+	cuq->stats.workers = U2FS_CUQ_WORKERS;
+}
+
+/*
+ * @sb is going away: drop the speculative requests and wait for the
+ * running ones, which hold dentries.  Nobody can be waiting for any.
+ */
+void u2fs_cuq_stop(struct super_block *sb)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct u2fs_cuq *cuq = &sbi->cuq;
+	struct u2fs_cureq *req;
+	LIST_HEAD(dropped);
+	int i;
+
+	set_bit(U2FS_SB_DYING, &sbi->state);
+
+	spin_lock(&cuq->lock);
+	list_splice_init(&cuq->queue[U2FS_CU_SPECULATIVE], &dropped);
+	cuq->stats.queued[U2FS_CU_SPECULATIVE] = 0;
+	list_for_each_entry(req, &dropped, list)
+		WRAPFS_I(req->dentry->d_inode)->cureq = NULL;
+	spin_unlock(&cuq->lock);
+
+	while (!list_empty(&dropped)) {
+		req = list_first_entry(&dropped, struct u2fs_cureq, list);
+		list_del_init(&req->list);
+		req->err = -EINTR;
+		complete_all(&req->done);
+		u2fs_cureq_put(req);
+	}
+
+	/* the queue is shared by all mounts, so only wait for our workers */
+	for (i = 0; i < U2FS_CUQ_WORKERS; i++)
+		flush_work(&cuq->worker[i].work);
+}
+
+int u2fs_cuq_init(void)
+{
+	u2fs_cuq_wq = alloc_workqueue("u2fs_cuq", WQ_UNBOUND, 0);
+	return u2fs_cuq_wq ? 0 : -ENOMEM;
+}
+
+void u2fs_cuq_exit(void)
+{
+	if (u2fs_cuq_wq)
+		destroy_workqueue(u2fs_cuq_wq);
+}
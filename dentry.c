@@ -11,6 +11,54 @@
 
 #include "wrapfs.h"
 
+/*
+ * Has another name of the hard linked right branch file @dentry been
+ * copied up?  The u2fs inode the names shared is then known by the copy
+ * (see u2fs_copyup_file), and @dentry needs a lookup to get its own.
+ */
+static inline int u2fs_shares_copied_inode(struct dentry *dentry)
+{
+	struct inode *inode = ACCESS_ONCE(dentry->d_inode);
+	struct dentry *lower_dentry;
+
+	if (!inode || !wrapfs_lower_inode(inode))
+		return 0;
+	lower_dentry = wrapfs_get_lower_dentry_rcu(dentry, 0);
+	return !lower_dentry || !ACCESS_ONCE(lower_dentry->d_inode);
+}
+
+/*
+ * Revalidate in RCU-walk mode.  We may neither sleep nor take references
+ * here, and the dentry may be going away under us: its private data is
+ * freed only after a grace period, and so are the lower dentries it
+ * points to.  A dentry whose lower dentries need no revalidation of their
+ * own is valid; everything else is left to ref-walk.
+ */
+static int wrapfs_d_revalidate_rcu(struct dentry *dentry)
+{
+	struct dentry *lower_dentry;
+	int i;
+
+	if (!ACCESS_ONCE(dentry->d_fsdata))
+		return -ECHILD;
+
+	if (u2fs_shares_copied_inode(dentry))
+		return -ECHILD;
+
+	for(i=0;i<MAX_BRANCHES;i++){
+		lower_dentry = wrapfs_get_lower_dentry_rcu(dentry, i);
+		if (!lower_dentry)
+			continue;
+		/* a negative dentry may have gone stale, see below */
+		if (!dentry->d_inode && lower_dentry->d_inode)
+			return -ECHILD;
+		if (d_unhashed(lower_dentry) ||
+		    (lower_dentry->d_flags & DCACHE_OP_REVALIDATE))
+			return -ECHILD;
+	}
+	return 1;
+}
+
 /*
  * returns: -ERRNO if error (returned to user)
  *          0: tell VFS to invalidate dentry
@@ -24,49 +72,54 @@ static int wrapfs_d_revalidate(struct dentry *dentry, struct nameidata *nd)
 	int err;
 	int i;
 
-	printk("The revalidate method is called\n");
-
 	err=1;
 	if (nd && nd->flags & LOOKUP_RCU)
-		return -ECHILD;
+		return wrapfs_d_revalidate_rcu(dentry);
 
-	for(i=0;i<MAX_BRANCHES;i++){
+	/*
+	 * A negative dentry stays valid until its name shows up in the left
+	 * branch; the right branch is read-only.
+	 */
+	if (!dentry->d_inode) {
+		lower_dentry = wrapfs_get_lower_dentry_idx(dentry, 0);
+		if (lower_dentry &&
+		    (lower_dentry->d_inode || d_unhashed(lower_dentry)))
+			return 0;
+		return 1;
+	}
+
+	if (u2fs_shares_copied_inode(dentry))
+		return 0;
+
+	for(i=0;i<MAX_BRANCHES && err>0;i++){
 		if(i==0)
 			wrapfs_get_lower_path(dentry, &lower_path);
 
 		if(i==1)
 			wrapfs_get_lower_path_right(dentry,&lower_path);
 
-		
 		lower_dentry = lower_path.dentry;
-		//printk("This is where I suspect the error to be\n");
-
-		if(lower_dentry){
-			 printk("The revalidate method is getting lower dentry\n");
-			if (!lower_dentry->d_op || !lower_dentry->d_op->d_revalidate)
-				goto out;
-			pathcpy(&saved_path, &nd->path);
-			pathcpy(&nd->path, &lower_path);
-			printk("The revalidate method calling lower\n");
-			err = lower_dentry->d_op->d_revalidate(lower_dentry, nd);
-			pathcpy(&nd->path, &saved_path);
-			if(err==0)
-				goto out;
+		if (lower_dentry && lower_dentry->d_op &&
+		    lower_dentry->d_op->d_revalidate) {
+			if (nd) {
+				pathcpy(&saved_path, &nd->path);
+				pathcpy(&nd->path, &lower_path);
+				err = lower_dentry->d_op->d_revalidate(lower_dentry,
+								       nd);
+				pathcpy(&nd->path, &saved_path);
+			} else {
+				err = lower_dentry->d_op->d_revalidate(lower_dentry,
+								       NULL);
+			}
 		}
-		
-	}	
-	
-	
-
-out:
-	wrapfs_put_lower_path(dentry, &lower_path);
-	//printk("put the lower the paths\n");
+		wrapfs_put_lower_path(dentry, &lower_path);
+	}
+
 	return err;
 }
 
 static void wrapfs_d_release(struct dentry *dentry)
 {
-	printk("D releasing\n");
 	/* release and reset the lower paths */
 	wrapfs_put_reset_lower_path(dentry);
 	free_dentry_private_data(dentry);
@@ -10,6 +10,7 @@
  */
 
 #include "wrapfs.h"
+#include <linux/splice.h>
 
 static ssize_t wrapfs_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *ppos)
@@ -21,7 +22,14 @@ static ssize_t wrapfs_read(struct file *file, char __user *buf,
 	err=0;
 
 	lower_file = wrapfs_lower_file(file);
-	if(lower_file){
+	if(lower_file && WRAPFS_I(dentry->d_inode)->emap){
+		/* a lazy copy-up: parts may still be in the right branch */
+		err = u2fs_lazy_read(file, buf, count, ppos);
+		if (err >= 0)
+			fsstack_copy_attr_atime(dentry->d_inode,
+					lower_file->f_path.dentry->d_inode);
+	}
+	else if(lower_file){
 		err = vfs_read(lower_file, buf, count, ppos);
 	/* update our inode atime upon a successful lower read */
 		if (err >= 0)
@@ -30,7 +38,6 @@ static ssize_t wrapfs_read(struct file *file, char __user *buf,
 	}
 
 	else{
-		printk("In wrapfs read could not find in left branch\n");
 		lower_file=wrapfs_lower_file_right(file);
 		if(lower_file){
 			 err = vfs_read(lower_file, buf, count, ppos);
@@ -53,11 +60,13 @@ static ssize_t wrapfs_write(struct file *file, const char __user *buf,
 	struct dentry *dentry = file->f_path.dentry;
 	
 
-	printk("Reached wrapfs_write\n");
-
 	lower_file = wrapfs_lower_file(file);
 	if(lower_file){
-		err = vfs_write(lower_file, buf, count, ppos);
+		/* a lazy copy-up: parts may still be in the right branch */
+		if (WRAPFS_I(dentry->d_inode)->emap)
+			err = u2fs_lazy_write(file, buf, count, ppos);
+		else
+			err = vfs_write(lower_file, buf, count, ppos);
 		/* update our inode times+sizes upon a successful lower write */
 		if (err >= 0) {
 			fsstack_copy_inode_size(dentry->d_inode,
@@ -77,54 +86,169 @@ static ssize_t wrapfs_write(struct file *file, const char __user *buf,
 	return err;
 }
 
-static int wrapfs_readdir(struct file *file, void *dirent, filldir_t filldir)
+/*
+ * SEEK_DATA and SEEK_HOLE are answered by the lower file, which knows
+ * where its holes are; the rest is ours.
+ */
+static loff_t wrapfs_llseek(struct file *file, loff_t offset, int origin)
 {
-	int err = 0;
-	struct file *lower_file = NULL;
+	struct inode *inode = file->f_path.dentry->d_inode;
+	struct file *lower_file;
+	loff_t pos;
+
+	if (origin != SEEK_DATA && origin != SEEK_HOLE)
+		return generic_file_llseek(file, offset, origin);
+
+	lower_file = wrapfs_lower_file(file);
+	if (!lower_file)
+		lower_file = wrapfs_lower_file_right(file);
+	if (!lower_file)
+		return generic_file_llseek(file, offset, origin);
+
+	/* dirty pages may fill what is still a hole in the lower file */
+	if (u2fs_pagecache(inode))
+		filemap_write_and_wait(file->f_mapping);
+
+	if (lower_file == wrapfs_lower_file(file) && WRAPFS_I(inode)->emap)
+		pos = u2fs_lazy_llseek(file, offset, origin);
+	else
+		pos = vfs_llseek(lower_file, offset, origin);
+	/* the lower file system does not know SEEK_DATA and SEEK_HOLE */
+	if (pos == -EINVAL)
+		return generic_file_llseek(file, offset, origin);
+
+	if (pos >= 0 && pos != file->f_pos) {
+		file->f_pos = pos;
+		file->f_version = 0;
+	}
+	return pos;
+}
+
+/*
+ * splice (and so sendfile) hands the pages of the lower file over as they
+ * are, instead of copying them through wrapfs_read's buffers.
+ */
+static ssize_t wrapfs_splice_read(struct file *file, loff_t *ppos,
+				  struct pipe_inode_info *pipe, size_t len,
+				  unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_file;
 	struct dentry *dentry = file->f_path.dentry;
-	int i=0;
 
-	printk("In the readdir method\n");
+	lower_file = wrapfs_lower_file(file);
+	if (!lower_file)
+		lower_file = wrapfs_lower_file_right(file);
+	if (!lower_file)
+		return -EINVAL;
+	/* lower files that cannot splice are read through wrapfs_read */
+	if (!lower_file->f_op || !lower_file->f_op->splice_read)
+		return default_file_splice_read(file, ppos, pipe, len, flags);
+
+	err = u2fs_lazy_fill(dentry, *ppos, len);
+	if (err)
+		return err;
 
-	printk("the directory name in readdir %s\n",dentry->d_name.name);
-	for(i=0;i<MAX_BRANCHES;i++){
-		if(i==0)
-			lower_file = wrapfs_lower_file(file);
-		if(i==1)
-			lower_file =wrapfs_lower_file_right(file);
+	err = lower_file->f_op->splice_read(lower_file, ppos, pipe, len, flags);
+	/* update our inode atime upon a successful lower read */
+	if (err >= 0)
+		fsstack_copy_attr_atime(dentry->d_inode,
+					lower_file->f_path.dentry->d_inode);
+	return err;
+}
 
-		if(!lower_file){
-			printk("In wrapfs readdir lower file not found in branch %d\n",i);
-			continue;
-		}
-			
-		err = vfs_readdir(lower_file, filldir, dirent);
+/*
+ * Write one pipe buffer through wrapfs_write, for lower files that cannot
+ * splice.  This is what the VFS does for files without ->splice_write,
+ * but its actor is not exported.
+ */
+static int u2fs_write_pipe_buf(struct pipe_inode_info *pipe,
+			       struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	mm_segment_t old_fs;
+	loff_t pos = sd->pos;
+	void *data;
+	int ret;
+
+	data = buf->ops->map(pipe, buf, 0);
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	ret = vfs_write(sd->u.file, (const char __user *)data + buf->offset,
+			sd->len, &pos);
+	set_fs(old_fs);
+	buf->ops->unmap(pipe, buf, data);
+	return ret;
+}
 
-		file->f_pos=lower_file->f_pos;
-		if(err>=0){
-                	fsstack_copy_attr_atime(dentry->d_inode,
-                                        lower_file->f_path.dentry->d_inode);
-		}
+static ssize_t wrapfs_splice_write(struct pipe_inode_info *pipe,
+				   struct file *file, loff_t *ppos, size_t len,
+				   unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_file;
+	struct dentry *dentry = file->f_path.dentry;
 
-	}
-	/*
-	file->f_pos =wrapfs_lower_file(file)->f_pos;
-	if (err >= 0){	
+	/* like wrapfs_write, only the left branch can be written to */
+	lower_file = wrapfs_lower_file(file);
+	if (!lower_file)
+		return -EPERM;
+	/* lower files that cannot splice are written through wrapfs_write */
+	if (!lower_file->f_op || !lower_file->f_op->splice_write)
+		return splice_from_pipe(pipe, file, ppos, len, flags,
+					u2fs_write_pipe_buf);
+	err = u2fs_lazy_fill(dentry, *ppos, len);
+	if (err)
+		return err;
 
-		lower_file
-		fsstack_copy_attr_atime(dentry->d_inode,
+	err = lower_file->f_op->splice_write(pipe, lower_file, ppos, len,
+					     flags);
+	/* update our inode times+sizes upon a successful lower write */
+	if (err >= 0) {
+		fsstack_copy_inode_size(dentry->d_inode,
+					lower_file->f_path.dentry->d_inode);
+		fsstack_copy_attr_times(dentry->d_inode,
 					lower_file->f_path.dentry->d_inode);
-	}*/
+	}
 	return err;
 }
 
+/* ioctls for u2fs itself; -ENOIOCTLCMD passes others to the lower file */
+static long u2fs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case U2FS_IOC_DROP_RSNAP:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		u2fs_rsnap_invalidate(file->f_path.dentry->d_sb);
+		return 0;
+	case U2FS_IOC_CLONE:
+	case U2FS_IOC_CLONE_RANGE:
+		return u2fs_ioctl_clone(file, cmd, arg);
+	case U2FS_IOC_COPY_RANGE:
+		return u2fs_ioctl_copy(file, arg);
+	case U2FS_IOC_CU_STATS:
+		return u2fs_cuq_stats(file->f_path.dentry->d_sb,
+				      (void __user *)arg);
+	}
+	return -ENOIOCTLCMD;
+}
+
 static long wrapfs_unlocked_ioctl(struct file *file, unsigned int cmd,
 				  unsigned long arg)
 {
 	long err = -ENOTTY;
 	struct file *lower_file;
 
-	lower_file = wrapfs_lower_file(file);
+	err = u2fs_ioctl(file, cmd, arg);
+	if (err != -ENOIOCTLCMD)
+		goto out;
+	err = -ENOTTY;
+
+	lower_file = u2fs_lower_file_idx(file, 0);
+	if (IS_ERR(lower_file)) {
+		err = PTR_ERR(lower_file);
+		goto out;
+	}
 
 	/* XXX: use vfs_ioctl if/when VFS exports it */
 	if (!lower_file || !lower_file->f_op)
@@ -143,7 +267,16 @@ static long wrapfs_compat_ioctl(struct file *file, unsigned int cmd,
 	long err = -ENOTTY;
 	struct file *lower_file;
 
-	lower_file = wrapfs_lower_file(file);
+	err = u2fs_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+	if (err != -ENOIOCTLCMD)
+		goto out;
+	err = -ENOTTY;
+
+	lower_file = u2fs_lower_file_idx(file, 0);
+	if (IS_ERR(lower_file)) {
+		err = PTR_ERR(lower_file);
+		goto out;
+	}
 
 	/* XXX: use vfs_ioctl if/when VFS exports it */
 	if (!lower_file || !lower_file->f_op)
@@ -166,6 +299,11 @@ static int wrapfs_mmap(struct file *file, struct vm_area_struct *vma)
 	/* this might be deferred to mmap's writepage */
 	willwrite = ((vma->vm_flags | VM_SHARED | VM_WRITE) == vma->vm_flags);
 
+	/* the mapping is of the left branch file, which needs all its data */
+	err = u2fs_lazy_finish(file->f_path.dentry);
+	if (err)
+		goto out;
+
 	/*
 	 * File systems which do not implement ->writepage may use
 	 * generic_file_readonly_mmap as their ->mmap op.  If you call
@@ -220,39 +358,55 @@ out:
 	return err;
 }
 
-static int __open_dir(struct inode *inode,struct file *file){
-	struct dentry *lower_dentry;
+/*
+ * Open the lower object of @file in branch @bindex, with the credentials
+ * @file was opened with.  Returns NULL if the object is not there.
+ */
+static struct file *u2fs_open_lower(struct file *file, int bindex)
+{
+	struct dentry *dentry = file->f_path.dentry;
 	struct path lower_path;
-	struct file *lower_file;
-	int i=0;
-
-	for(i=0;i<MAX_BRANCHES;i++){
-		lower_dentry=wrapfs_get_lower_dentry_idx(file->f_path.dentry,i);
-		if(!lower_dentry)
-			continue;
-		dget(lower_dentry);
-		
-		if(i==0)
-			wrapfs_get_lower_path(file->f_path.dentry,&lower_path);
-		if(i==1)
-			wrapfs_get_lower_path_right(file->f_path.dentry,&lower_path);
-
 
-		lower_file=dentry_open(lower_dentry,lower_path.mnt,file->f_flags,current_cred());
-		if(IS_ERR(lower_file)){
-			wrapfs_put_lower_path(file->f_path.dentry,&lower_path);
-			return PTR_ERR(lower_file);
-		}
-		
-		
-		wrapfs_set_lower_file(file,lower_file,i);
-		wrapfs_put_lower_path(file->f_path.dentry,&lower_path);
-		
+	if (bindex == 0)
+		wrapfs_get_lower_path(dentry, &lower_path);
+	else
+		wrapfs_get_lower_path_right(dentry, &lower_path);
+	if (!lower_path.dentry || !lower_path.dentry->d_inode) {
+		path_put(&lower_path);
+		return NULL;
+	}
+	/* dentry_open consumes our references, even on error */
+	return dentry_open(lower_path.dentry, lower_path.mnt, file->f_flags,
+			   file->f_cred);
+}
 
-		//Should add branch get??
-			
+/*
+ * The lower file of @file in branch @bindex.  Directories do not open
+ * their lower directories in ->open, as most directory fds are only used
+ * for fstat and *at() lookups; this opens them on first use instead.
+ * Returns NULL if the object is not in that branch.
+ */
+struct file *u2fs_lower_file_idx(struct file *file, int bindex)
+{
+	struct file **slot = bindex ? &WRAPFS_F(file)->lower_file_right :
+				      &WRAPFS_F(file)->lower_file;
+	struct file *lower_file, *old;
+
+	lower_file = ACCESS_ONCE(*slot);
+	if (lower_file || !S_ISDIR(file->f_path.dentry->d_inode->i_mode) ||
+	    !u2fs_has_branch(file->f_path.dentry, bindex))
+		return lower_file;
+
+	lower_file = u2fs_open_lower(file, bindex);
+	if (IS_ERR_OR_NULL(lower_file))
+		return lower_file;
+	/* readdir holds i_mutex, but fsync and ioctl do not */
+	old = cmpxchg(slot, NULL, lower_file);
+	if (old) {
+		fput(lower_file);
+		lower_file = old;
 	}
-	return 0;
+	return lower_file;
 }
 
 
@@ -260,10 +414,7 @@ static int wrapfs_open(struct inode *inode, struct file *file)
 {
 	int err = 0;
 	struct file *lower_file = NULL;
-	struct path lower_path;
-	
-	
-	printk("in wrapfs open function\n");
+	int i;
 
 	/* don't open unhashed/deleted files */
 	if (d_unhashed(file->f_path.dentry)) {
@@ -278,59 +429,40 @@ static int wrapfs_open(struct inode *inode, struct file *file)
 		goto out_err;
 	}
 
-	if(S_ISDIR(inode->i_mode)){
-		err=__open_dir(inode,file);
-		printk("File is a directory\n");
+	/* writing to a right branch file writes to a copy in the left one */
+	if (S_ISREG(inode->i_mode) &&
+	    ((file->f_flags & O_ACCMODE) != O_RDONLY ||
+	     (file->f_flags & O_TRUNC)) &&
+	    !u2fs_has_branch(file->f_path.dentry, 0)) {
+		err = u2fs_cuq_run(file->f_path.dentry, U2FS_CU_COPYUP,
+				   (file->f_flags & O_TRUNC) ?
+				   0 : i_size_read(inode));
+		if (err) {
+			kfree(WRAPFS_F(file));
+			goto out_err;
+		}
 	}
 
-	else{
-		/* open lower object and link wrapfs's file struct to lower's */
-		wrapfs_get_lower_path(file->f_path.dentry, &lower_path);
-		printk("Before opening the lower_file\n");
-		if(lower_path.dentry){
-			dget(lower_path.dentry);
-			lower_file = dentry_open(lower_path.dentry, lower_path.mnt,
-				 	file->f_flags, current_cred());
-			if (IS_ERR(lower_file)) {
-				printk("Error opening the lower file\n");
-				err = PTR_ERR(lower_file);
-				lower_file = wrapfs_lower_file(file);
-				if (lower_file) {
-					wrapfs_set_lower_file(file, NULL,0);
-					fput(lower_file); /* fput calls dput for lower_dentry */
-				}
-			} else 	{	
-				wrapfs_set_lower_file(file, lower_file,0);
+	/* directories open their lower directories lazily */
+	if(!S_ISDIR(inode->i_mode)){
+		/* open the lower file of the topmost branch */
+		for(i=0;i<MAX_BRANCHES && !lower_file;i++){
+			lower_file=u2fs_open_lower(file,i);
+			if(IS_ERR(lower_file)){
+				err=PTR_ERR(lower_file);
+				break;
 			}
-			wrapfs_put_lower_path(file->f_path.dentry,&lower_path);
+			if(lower_file)
+				wrapfs_set_lower_file(file,lower_file,i);
 		}
-		else{
-			wrapfs_put_lower_path(file->f_path.dentry,&lower_path);
-			wrapfs_get_lower_path_right(file->f_path.dentry,&lower_path);
-			if(lower_path.dentry){
-				dget(lower_path.dentry);
-				lower_file=dentry_open(lower_path.dentry,lower_path.mnt,
-						 	file->f_flags, current_cred());
-				if(IS_ERR(lower_file)){
-					err=PTR_ERR(lower_file);
-					lower_file=wrapfs_lower_file_right(file);
-					if(lower_file){
-						wrapfs_set_lower_file(file,NULL,1);
-						fput(lower_file);
-					}
-				}
-				else{
-					wrapfs_set_lower_file(file,lower_file,1);
-				}
-			}
-			wrapfs_put_lower_path(file->f_path.dentry,&lower_path);
-		}		
-	}		
-
+	}
 
+	if (!err && u2fs_pagecache(inode))
+		err = u2fs_pc_open(file);
+	if (!err && S_ISREG(inode->i_mode))
+		err = u2fs_lazy_open(file);
 
 	if (err){
-		printk("there seems to be a problem here\n");
 		lower_file=wrapfs_lower_file(file);
 		if(lower_file){
 			wrapfs_set_lower_file(file,NULL,0);
@@ -346,11 +478,9 @@ static int wrapfs_open(struct inode *inode, struct file *file)
 	}
 	else{
 		if(wrapfs_lower_inode_right(inode)){
-			printk("In wrapfs open setting attrs for lower inode right\n");
 			fsstack_copy_attr_all(inode, wrapfs_lower_inode_right(inode));
 		}
 		if(wrapfs_lower_inode(inode)){
-			 printk("In wrapfs open setting lower inode\n");
 			 fsstack_copy_attr_all(inode, wrapfs_lower_inode(inode));
 
 		}
@@ -364,10 +494,18 @@ static int wrapfs_flush(struct file *file, fl_owner_t id)
 	int err = 0;
 	struct file *lower_file = NULL;
 
+	/* report writeback errors of page cached files at close */
+	if ((file->f_mode & FMODE_WRITE) &&
+	    u2fs_pagecache(file->f_path.dentry->d_inode)) {
+		err = filemap_write_and_wait(file->f_mapping);
+		if (err)
+			goto out;
+	}
+
 	lower_file = wrapfs_lower_file(file);
 	if (lower_file && lower_file->f_op && lower_file->f_op->flush)
 		err = lower_file->f_op->flush(lower_file, id);
-
+out:
 	return err;
 }
 
@@ -389,6 +527,10 @@ static int wrapfs_file_release(struct inode *inode, struct file *file)
 		fput(lower_file_right);
 	}
 
+	if (u2fs_pagecache(inode))
+		u2fs_pc_release(inode);
+	u2fs_lazy_release(file);
+	u2fs_rdcache_free(WRAPFS_F(file)->rdcache);
 	kfree(WRAPFS_F(file));
 	return 0;
 }
@@ -398,16 +540,18 @@ static int wrapfs_fsync(struct file *file, loff_t start, loff_t end,
 {
 	int err;
 	struct file *lower_file;
-	struct path lower_path;
-	struct dentry *dentry = file->f_path.dentry;
 
 	err = generic_file_fsync(file, start, end, datasync);
 	if (err)
 		goto out;
-	lower_file = wrapfs_lower_file(file);
-	wrapfs_get_lower_path(dentry, &lower_path);
-	err = vfs_fsync_range(lower_file, start, end, datasync);
-	wrapfs_put_lower_path(dentry, &lower_path);
+	/* the right branch is read-only, there is nothing to sync there */
+	lower_file = u2fs_lower_file_idx(file, 0);
+	if (IS_ERR(lower_file)) {
+		err = PTR_ERR(lower_file);
+		goto out;
+	}
+	if (lower_file)
+		err = vfs_fsync_range(lower_file, start, end, datasync);
 out:
 	return err;
 }
@@ -418,14 +562,14 @@ static int wrapfs_fasync(int fd, struct file *file, int flag)
 	struct file *lower_file = NULL;
 
 	lower_file = wrapfs_lower_file(file);
-	if (lower_file->f_op && lower_file->f_op->fasync)
+	if (lower_file && lower_file->f_op && lower_file->f_op->fasync)
 		err = lower_file->f_op->fasync(fd, lower_file, flag);
 
 	return err;
 }
 
 const struct file_operations wrapfs_main_fops = {
-	.llseek		= generic_file_llseek,
+	.llseek		= wrapfs_llseek,
 	.read		= wrapfs_read,
 	.write		= wrapfs_write,
 	.unlocked_ioctl	= wrapfs_unlocked_ioctl,
@@ -438,13 +582,45 @@ const struct file_operations wrapfs_main_fops = {
 	.release	= wrapfs_file_release,
 	.fsync		= wrapfs_fsync,
 	.fasync		= wrapfs_fasync,
+	.splice_read	= wrapfs_splice_read,
+	.splice_write	= wrapfs_splice_write,
+};
+
+static int u2fs_pc_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	/* dirty pages can only be written back to the left branch */
+	if ((vma->vm_flags & (VM_SHARED | VM_WRITE)) ==
+	    (VM_SHARED | VM_WRITE) && !wrapfs_lower_file(file))
+		return -EPERM;
+	return generic_file_mmap(file, vma);
+}
+
+/* regular files of "pagecache" mounts, see mmap.c */
+const struct file_operations u2fs_pc_fops = {
+	.llseek		= wrapfs_llseek,
+	.read		= do_sync_read,
+	.aio_read	= generic_file_aio_read,
+	.write		= do_sync_write,
+	.aio_write	= generic_file_aio_write,
+	.unlocked_ioctl	= wrapfs_unlocked_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= wrapfs_compat_ioctl,
+#endif
+	.mmap		= u2fs_pc_mmap,
+	.open		= wrapfs_open,
+	.flush		= wrapfs_flush,
+	.release	= wrapfs_file_release,
+	.fsync		= wrapfs_fsync,
+	.fasync		= wrapfs_fasync,
+	.splice_read	= generic_file_splice_read,
+	.splice_write	= generic_file_splice_write,
 };
 
 /* trimmed directory options */
 const struct file_operations wrapfs_dir_fops = {
 	.llseek		= generic_file_llseek,
 	.read		= generic_read_dir,
-	.readdir	= wrapfs_readdir,
+	.readdir	= u2fs_readdir,
 	.unlocked_ioctl	= wrapfs_unlocked_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= wrapfs_compat_ioctl,
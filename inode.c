@@ -21,15 +21,21 @@ static int wrapfs_create(struct inode *dir, struct dentry *dentry,
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path, saved_path;
+	int whiteout;
+
+	/* the new object may replace a whited out one */
+	whiteout = u2fs_wh_lookup(dentry->d_parent, &dentry->d_name);
+	if (whiteout < 0)
+		return whiteout;
+	err = u2fs_copyup_negative(dentry);
+	if (err)
+		return err;
 
-	printk("In the create method\n");
 	wrapfs_get_lower_path(dentry, &lower_path);
 
 	lower_dentry = lower_path.dentry;
 	lower_parent_dentry = lock_parent(lower_dentry);
 
-	printk("the lower parent dentry in wrapfs_create is %s\n",lower_parent_dentry->d_name.name);
-
 	err = mnt_want_write(lower_path.mnt);
 	if (err)
 		goto out_unlock;
@@ -40,7 +46,15 @@ static int wrapfs_create(struct inode *dir, struct dentry *dentry,
 	pathcpy(&nd->path, &saved_path);
 	if (err)
 		goto out;
+	if (whiteout) {
+		err = u2fs_wh_remove(dentry->d_parent, lower_parent_dentry,
+				     &dentry->d_name);
+		if (err)
+			goto out;
+	}
 
+	wrapfs_put_reset_lower_path_right(dentry);
+	u2fs_set_branches(dentry, U2FS_BR_LEFT);
 	err = u2fs_interpose(dentry, dir->i_sb);
 	if (err)
 		goto out;
@@ -65,6 +79,20 @@ static int wrapfs_link(struct dentry *old_dentry, struct inode *dir,
 	u64 file_size_save;
 	int err;
 	struct path lower_old_path, lower_new_path;
+	int whiteout;
+
+	/* a lazy copy-up finds its right branch data by name */
+	err = u2fs_lazy_finish(old_dentry);
+	if (err)
+		return err;
+
+	/* the new object may replace a whited out one */
+	whiteout = u2fs_wh_lookup(new_dentry->d_parent, &new_dentry->d_name);
+	if (whiteout < 0)
+		return whiteout;
+	err = u2fs_copyup_negative(new_dentry);
+	if (err)
+		return err;
 
 	file_size_save = i_size_read(old_dentry->d_inode);
 	wrapfs_get_lower_path(old_dentry, &lower_old_path);
@@ -81,6 +109,12 @@ static int wrapfs_link(struct dentry *old_dentry, struct inode *dir,
 		       lower_new_dentry);
 	if (err || !lower_new_dentry->d_inode)
 		goto out;
+	if (whiteout) {
+		err = u2fs_wh_remove(new_dentry->d_parent, lower_dir_dentry,
+				     &new_dentry->d_name);
+		if (err)
+			goto out;
+	}
 
 	err = wrapfs_interpose(new_dentry, dir->i_sb, &lower_new_path);
 	if (err)
@@ -125,94 +159,6 @@ char *alloc_whname(const char *name,const char*pname, int len,int plen)
 }
 
 
-struct dentry *create_parents(struct inode *dir, struct dentry *dentry,
-				const char *name){
-
-	struct dentry *parent_dentry;
-	struct dentry *d;
-	struct dentry *child;
-
-	d=NULL;
-	parent_dentry=dentry;
-	
-	do{
-		child=parent_dentry;	
-		parent_dentry=dget_parent(child);
-
-		printk("The parent dentry in create parents is %s\n",parent_dentry->d_name.name);
-
-		if(IS_ROOT(parent_dentry)){
-			printk("The parent is root\n");	
-			d=wrapfs_get_lower_dentry_idx(parent_dentry,0);
-			break;
-		}	
-		dput(parent_dentry);
-
-	}while(!d);
-	
-	dput(parent_dentry);
-	return d;
-
-}
-
-
-int create_whiteout(struct dentry *dentry){
-
-	struct dentry *lower_dir_dentry;
-	struct dentry *lower_dentry;
-	struct dentry *lower_wh_dentry;
-	char *name;
-	int err;
-	int tlen;
-
-	name=NULL;
-	err=-EINVAL;
-
-	printk("In the create whiteout method\n");
-
-	name=alloc_whname(dentry->d_name.name,dentry->d_parent->d_name.name, dentry->d_name.len,dentry->d_parent->d_name.len);
-	printk("The file to whiteout is %s\n",name);
-
-	lower_dentry=wrapfs_get_lower_dentry_idx(dentry,0);
-	if(!lower_dentry){
-		printk("In create whiteout the lower_dentry does not exists\n");
-		lower_dentry=create_parents(dentry->d_inode,dentry,dentry->d_name.name);
-		printk("In the create whiteout the lower dentry name is %s and parent is %s\n",lower_dentry->d_name.name,lower_dentry->d_parent->d_name.name);
-		
-
-		if(strcmp(dentry->d_parent->d_name.name,"/")!=0)
-			tlen=dentry->d_name.len+dentry->d_parent->d_name.len+U2FS_WHLEN+1;
-		/*Need to lookup whiteout in the left branch to see if the same whiteout exists*/
-		else
-			tlen=dentry->d_name.len+U2FS_WHLEN;
-
-		lower_wh_dentry=lookup_one_len(name,lower_dentry,tlen);
-
-		
-
-		if(IS_ERR(lower_wh_dentry)){
-			printk("lower wh dsnt work\n");
-			err=PTR_ERR(lower_wh_dentry);
-			goto out;
-		}
-		
-
-		
-		printk("lower wh entry is %s\n",lower_wh_dentry->d_name.name);		
-
-		lower_dir_dentry=lock_parent(lower_dentry);
-		err=vfs_create(lower_dir_dentry->d_inode,lower_wh_dentry,S_IRUGO,NULL);
-		unlock_dir(lower_dir_dentry);
-		dput(lower_wh_dentry);
-	}
-	
-out:
-	kfree(name);
-	return err;
-}
-
-
-
 static int wrapfs_unlink(struct inode *dir, struct dentry *dentry)
 {
 
@@ -223,8 +169,6 @@ static int wrapfs_unlink(struct inode *dir, struct dentry *dentry)
 	struct path lower_path;
 
 
-	printk("In wrapfs lookup\n");
-
 	wrapfs_get_lower_path(dentry, &lower_path);
 	if(lower_path.dentry){
 		lower_dentry = lower_path.dentry;
@@ -258,10 +202,9 @@ static int wrapfs_unlink(struct inode *dir, struct dentry *dentry)
 
 	else{
 		wrapfs_put_lower_path(dentry,&lower_path);
-		wrapfs_get_lower_path_right(dentry,&lower_path);
-		printk("In wrapfs unlink, need to create whiteout\n");
 		err=create_whiteout(dentry);
-		printk("You got trolled and the err is %d\n",err);
+		if(!err)
+			d_drop(dentry);
 		return err;	
 
 	}
@@ -273,6 +216,9 @@ out_unlock:
 	unlock_dir(lower_dir_dentry);
 	dput(lower_dentry);
 	wrapfs_put_lower_path(dentry, &lower_path);
+	/* a copy in the right branch would show through otherwise */
+	if(!err && wrapfs_get_lower_dentry_idx(dentry,1))
+		err=create_whiteout(dentry);
 	return err;
 }
 
@@ -283,6 +229,15 @@ static int wrapfs_symlink(struct inode *dir, struct dentry *dentry,
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
+	int whiteout;
+
+	/* the new object may replace a whited out one */
+	whiteout = u2fs_wh_lookup(dentry->d_parent, &dentry->d_name);
+	if (whiteout < 0)
+		return whiteout;
+	err = u2fs_copyup_negative(dentry);
+	if (err)
+		return err;
 
 	wrapfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -294,6 +249,12 @@ static int wrapfs_symlink(struct inode *dir, struct dentry *dentry,
 	err = vfs_symlink(lower_parent_dentry->d_inode, lower_dentry, symname);
 	if (err)
 		goto out;
+	if (whiteout) {
+		err = u2fs_wh_remove(dentry->d_parent, lower_parent_dentry,
+				     &dentry->d_name);
+		if (err)
+			goto out;
+	}
 	err = wrapfs_interpose(dentry, dir->i_sb, &lower_path);
 	if (err)
 		goto out;
@@ -314,6 +275,22 @@ static int wrapfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
+	int whiteout;
+	int opaque;
+
+	/*
+	 * The new directory must not show the contents of a right branch
+	 * directory it replaces.  Marking it opaque also when its parent
+	 * exists in the right branch spares lookups of it a right branch
+	 * probe.
+	 */
+	whiteout = u2fs_wh_lookup(dentry->d_parent, &dentry->d_name);
+	if (whiteout < 0)
+		return whiteout;
+	opaque = whiteout || u2fs_has_branch(dentry->d_parent, 1);
+	err = u2fs_copyup_negative(dentry);
+	if (err)
+		return err;
 
 	wrapfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -325,7 +302,20 @@ static int wrapfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 	err = vfs_mkdir(lower_parent_dentry->d_inode, lower_dentry, mode);
 	if (err)
 		goto out;
+	if (whiteout) {
+		err = u2fs_wh_remove(dentry->d_parent, lower_parent_dentry,
+				     &dentry->d_name);
+		if (err)
+			goto out;
+	}
 
+	/*
+	 * The new directory lives in the left branch only: a right branch
+	 * one left over from a removed object is whited out or hidden by
+	 * the opaque marker.
+	 */
+	wrapfs_put_reset_lower_path_right(dentry);
+	u2fs_set_branches(dentry, U2FS_BR_LEFT);
 	err = u2fs_interpose(dentry, dir->i_sb);
 	if (err)
 		goto out;
@@ -340,6 +330,8 @@ out:
 out_unlock:
 	unlock_dir(lower_parent_dentry);
 	wrapfs_put_lower_path(dentry, &lower_path);
+	if (!err && opaque)
+		err = u2fs_set_opaque(dentry);
 	return err;
 }
 
@@ -348,19 +340,63 @@ static int wrapfs_rmdir(struct inode *dir, struct dentry *dentry)
 	struct dentry *lower_dentry;
 	struct dentry *lower_dir_dentry;
 	int err;
+	int whiteouts;
+	int need_wh;
 	struct path lower_path;
 
+	/* only whiteouts may be left behind in the left branch directory */
+	whiteouts = u2fs_wh_empty_dir(dentry);
+	if (whiteouts < 0)
+		return whiteouts;
+
+	/*
+	 * A copy in the right branch would show through otherwise.  An
+	 * opaque directory may be hiding one we never looked up.
+	 */
+	need_wh = wrapfs_get_lower_dentry_idx(dentry, 1) ||
+		WRAPFS_D(dentry)->opaque;
+
 	wrapfs_get_lower_path(dentry, &lower_path);
 	if(lower_path.dentry){
 		lower_dentry = lower_path.dentry;
-		lower_dir_dentry = lock_parent(lower_dentry);
+		lower_dir_dentry = dget_parent(lower_dentry);
 
-		err = mnt_want_write(lower_path.mnt);
-		if (err)
+		/*
+		 * The whiteout comes first: if it failed once the directory
+		 * is gone, the right branch one and everything the whiteouts
+		 * inside it hid would show through.
+		 */
+		if (need_wh) {
+			err = create_whiteout(dentry);
+			if (err) {
+				dput(lower_dir_dentry);
+				goto out_put;
+			}
+		}
+
+		/* whiteouts stay until the directory is certain to go */
+		if (whiteouts)
+			err = u2fs_wh_rmdir(dentry, &lower_path);
+		mutex_lock_nested(&lower_dir_dentry->d_inode->i_mutex,
+				  I_MUTEX_PARENT);
+		if (!whiteouts) {
+			err = mnt_want_write(lower_path.mnt);
+			if (!err) {
+				err = vfs_rmdir(lower_dir_dentry->d_inode,
+						lower_dentry);
+				mnt_drop_write(lower_path.mnt);
+			}
+		}
+		if (err) {
+			/* the directory stays, so its whiteout has to go */
+			if (need_wh && !mnt_want_write(lower_path.mnt)) {
+				u2fs_wh_remove(dentry->d_parent,
+					       lower_dir_dentry,
+					       &dentry->d_name);
+				mnt_drop_write(lower_path.mnt);
+			}
 			goto out_unlock;
-		err = vfs_rmdir(lower_dir_dentry->d_inode, lower_dentry);
-		if (err)
-			goto out;
+		}
 
 		d_drop(dentry);	/* drop our dentry on success (why not VFS's job?) */
 		if (dentry->d_inode)
@@ -372,20 +408,20 @@ static int wrapfs_rmdir(struct inode *dir, struct dentry *dentry)
 	else{
 		
 		wrapfs_put_lower_path(dentry,&lower_path);
-                wrapfs_get_lower_path_right(dentry,&lower_path);
-                printk("In wrapfs rmdir, need to create whiteout\n");
                 err=create_whiteout(dentry);
-                printk("You got trolled and the err is %d\n",err);
+		if(!err){
+			d_drop(dentry);
+			clear_nlink(dentry->d_inode);
+		}
                 return err;
 
 	}
 
 	
 
-out:
-	mnt_drop_write(lower_path.mnt);
 out_unlock:
 	unlock_dir(lower_dir_dentry);
+out_put:
 	wrapfs_put_lower_path(dentry, &lower_path);
 	return err;
 }
@@ -397,6 +433,15 @@ static int wrapfs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
+	int whiteout;
+
+	/* the new object may replace a whited out one */
+	whiteout = u2fs_wh_lookup(dentry->d_parent, &dentry->d_name);
+	if (whiteout < 0)
+		return whiteout;
+	err = u2fs_copyup_negative(dentry);
+	if (err)
+		return err;
 
 	wrapfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -408,6 +453,12 @@ static int wrapfs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 	err = vfs_mknod(lower_parent_dentry->d_inode, lower_dentry, mode, dev);
 	if (err)
 		goto out;
+	if (whiteout) {
+		err = u2fs_wh_remove(dentry->d_parent, lower_parent_dentry,
+				     &dentry->d_name);
+		if (err)
+			goto out;
+	}
 
 	err = wrapfs_interpose(dentry, dir->i_sb, &lower_path);
 	if (err)
@@ -437,6 +488,34 @@ static int wrapfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	struct dentry *lower_new_dir_dentry = NULL;
 	struct dentry *trap = NULL;
 	struct path lower_old_path, lower_new_path;
+	int old_on_right;
+	int whiteout;
+	int opaque;
+
+	/*
+	 * Only objects in the left branch can be renamed there.  Merged
+	 * directories would have to be copied up entry by entry; EXDEV
+	 * makes mv(1) fall back to copying.
+	 */
+	old_on_right = wrapfs_get_lower_dentry_idx(old_dentry, 1) != NULL;
+	if (!wrapfs_get_lower_dentry_idx(old_dentry, 0) ||
+	    (old_on_right && S_ISDIR(old_dentry->d_inode->i_mode)))
+		return -EXDEV;
+	/* a lazy copy-up finds its right branch data by name */
+	err = u2fs_lazy_finish(old_dentry);
+	if (err)
+		return err;
+
+	/* the target name may be whited out, or only cached as negative */
+	whiteout = u2fs_wh_lookup(new_dentry->d_parent, &new_dentry->d_name);
+	if (whiteout < 0)
+		return whiteout;
+	/* a moved directory hides the right branch below its new name */
+	opaque = S_ISDIR(old_dentry->d_inode->i_mode) &&
+		(whiteout || u2fs_has_branch(new_dentry->d_parent, 1));
+	err = u2fs_copyup_negative(new_dentry);
+	if (err)
+		return err;
 
 	wrapfs_get_lower_path(old_dentry, &lower_old_path);
 	wrapfs_get_lower_path(new_dentry, &lower_new_path);
@@ -468,6 +547,13 @@ static int wrapfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 			 lower_new_dir_dentry->d_inode, lower_new_dentry);
 	if (err)
 		goto out_err;
+	if (whiteout) {
+		err = u2fs_wh_remove(new_dentry->d_parent,
+				     lower_new_dir_dentry,
+				     &new_dentry->d_name);
+		if (err)
+			goto out_err;
+	}
 
 	fsstack_copy_attr_all(new_dir, lower_new_dir_dentry->d_inode);
 	fsstack_copy_inode_size(new_dir, lower_new_dir_dentry->d_inode);
@@ -488,6 +574,20 @@ out:
 	dput(lower_new_dir_dentry);
 	wrapfs_put_lower_path(old_dentry, &lower_old_path);
 	wrapfs_put_lower_path(new_dentry, &lower_new_path);
+
+	/*
+	 * The right branch copy of the old name must not show through, and
+	 * it has nothing to do with the new name.  The VFS d_move()s our
+	 * dentries after we return.
+	 */
+	if (!err && old_on_right) {
+		err = create_whiteout(old_dentry);
+		wrapfs_put_reset_lower_path_right(old_dentry);
+	}
+	if (!err)
+		u2fs_set_branches(old_dentry, U2FS_BR_LEFT);
+	if (!err && opaque && !WRAPFS_D(old_dentry)->opaque)
+		err = u2fs_set_opaque(old_dentry);
 	return err;
 }
 
@@ -558,17 +658,25 @@ static int wrapfs_permission(struct inode *inode, int mask)
 {
 	struct inode *lower_inode;
 	int err;
-	
-	printk("In the permission method\n");
 
+	/*
+	 * This is called for every path component, possibly in RCU-walk
+	 * mode with MAY_NOT_BLOCK set in @mask: it must not sleep, and
+	 * inode_permission passes the flag on to the lower file system.
+	 */
 	lower_inode = wrapfs_lower_inode(inode);
-	if(lower_inode)
-		err = inode_permission(lower_inode, mask);
-	else{
-		printk("Permission not found in left inode\n");
-		lower_inode=wrapfs_lower_inode_right(inode);
-		err=inode_permission(lower_inode,mask);
-	}
+	if (lower_inode)
+		return inode_permission(lower_inode, mask);
+
+	/*
+	 * Writing to a right branch object writes to its copy up in the
+	 * left branch, so the right branch being read-only must not fail
+	 * it: check our own copy of the right inode's attributes instead.
+	 */
+	if (mask & MAY_WRITE)
+		err = generic_permission(inode, mask);
+	else
+		err = inode_permission(wrapfs_lower_inode_right(inode), mask);
 	return err;
 }
 
@@ -592,6 +700,20 @@ static int wrapfs_setattr(struct dentry *dentry, struct iattr *ia)
 	if (err)
 		goto out_err;
 
+	/* right branch objects are copied up before they change */
+	if (!u2fs_has_branch(dentry, 0)) {
+		if (S_ISDIR(inode->i_mode))
+			err = u2fs_copyup_parents(dentry);
+		else
+			/* chmod, chown and touch leave the data behind */
+			err = u2fs_copyup_file(dentry,
+					       (ia->ia_valid & ATTR_SIZE) ?
+					       ia->ia_size : i_size_read(inode),
+					       !(ia->ia_valid & ATTR_SIZE));
+		if (err)
+			goto out_err;
+	}
+
 	wrapfs_get_lower_path(dentry, &lower_path);
 	
 	if(lower_path.dentry){
@@ -615,6 +737,10 @@ static int wrapfs_setattr(struct dentry *dentry, struct iattr *ia)
 	 */
 		if (ia->ia_valid & ATTR_SIZE) {
 			err = inode_newsize_ok(inode, ia->ia_size);
+			if (err)
+				goto out;
+			/* cut chunks must not show through from the right */
+			err = u2fs_lazy_truncate(dentry, ia->ia_size);
 			if (err)
 				goto out;
 			truncate_setsize(inode, ia->ia_size);
@@ -636,6 +762,8 @@ static int wrapfs_setattr(struct dentry *dentry, struct iattr *ia)
 		mutex_lock(&lower_dentry->d_inode->i_mutex);
 		err = notify_change(lower_dentry, &lower_ia); /* note: lower_ia */
 		mutex_unlock(&lower_dentry->d_inode->i_mutex);
+		if (ia->ia_valid & ATTR_SIZE)
+			err = u2fs_lazy_truncate_end(dentry, ia->ia_size, err);
 		if (err)
 			goto out;
 
@@ -659,11 +787,39 @@ out_err:
 	return err;
 }
 
+/*
+ * Cached inodes can outlive changes made to the lower objects, so stat
+ * goes to the lower file system and refreshes our copy of the attributes.
+ */
+static int wrapfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
+			  struct kstat *stat)
+{
+	int err;
+	struct inode *inode = dentry->d_inode;
+	struct path lower_path;
+
+	wrapfs_get_lower_path(dentry, &lower_path);
+	if (!lower_path.dentry) {
+		wrapfs_put_lower_path(dentry, &lower_path);
+		wrapfs_get_lower_path_right(dentry, &lower_path);
+	}
+	err = vfs_getattr(lower_path.mnt, lower_path.dentry, stat);
+	wrapfs_put_lower_path(dentry, &lower_path);
+	if (err)
+		return err;
+
+	fsstack_copy_attr_all(inode, u2fs_lower_inode_top(inode));
+	u2fs_copy_inode_size(inode, u2fs_lower_inode_top(inode));
+	generic_fillattr(inode, stat);
+	return 0;
+}
+
 const struct inode_operations wrapfs_symlink_iops = {
 	.readlink	= wrapfs_readlink,
 	.permission	= wrapfs_permission,
 	.follow_link	= wrapfs_follow_link,
 	.setattr	= wrapfs_setattr,
+	.getattr	= wrapfs_getattr,
 	.put_link	= wrapfs_put_link,
 };
 
@@ -679,9 +835,11 @@ const struct inode_operations wrapfs_dir_iops = {
 	.rename		= wrapfs_rename,
 	.permission	= wrapfs_permission,
 	.setattr	= wrapfs_setattr,
+	.getattr	= wrapfs_getattr,
 };
 
 const struct inode_operations wrapfs_main_iops = {
 	.permission	= wrapfs_permission,
 	.setattr	= wrapfs_setattr,
+	.getattr	= wrapfs_getattr,
 };
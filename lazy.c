@@ -0,0 +1,661 @@
+/*
+ * Copyright (c) 1998-2011 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2011 Stony Brook University
+ * Copyright (c) 2003-2011 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "wrapfs.h"
+#include <linux/xattr.h>
+
+/*
+ * Lazy copy-up ("lazycopyup=N" mount option).  Copying a large right
+ * branch file up only creates a sparse left branch file of the same size,
+ * the shadow, and splits it into at most U2FS_EMAP_MAXCHUNKS chunks.  An
+ * extent map, kept in an xattr of the shadow, has a bit set for every
+ * chunk whose data is in the shadow.  Reads of the other chunks go to the
+ * right branch file; writes copy the chunks they touch first, unless
+ * they overwrite them whole.  Once the last writer is gone, a worker
+ * copies the remaining chunks and removes the map, which leaves an
+ * ordinary left branch file behind.
+ *
+ * A bit is only set once all of its chunk is in the shadow, copied there
+ * or written by a write that succeeded, so the map survives crashes and
+ * failed writes.  Writes and truncates hold the map lock while they
+ * change the shadow, so that no chunk is copied in the middle of one.
+ */
+
+#define U2FS_EMAP_MAGIC		0x75326d31	/* "u2m1" */
+#define U2FS_EMAP_MINSHIFT	20		/* chunks of 1MB at least */
+#define U2FS_EMAP_MAXCHUNKS	(8 * 2048)	/* 2KB of bits in the xattr */
+
+struct u2fs_emap_disk {
+	__le32 magic;
+	__le32 shift;
+	__le64 size;
+	unsigned long bits[0];	/* little endian bitmap, one bit per chunk */
+};
+
+struct u2fs_emap {
+	struct mutex lock;		/* serializes copying and storing */
+	unsigned int shift;		/* chunk size is 1 << shift */
+	loff_t size;			/* of the right branch file */
+	unsigned long nchunks;
+	unsigned long left;		/* chunks still to be copied */
+	size_t disk_len;		/* of the xattr value */
+	struct u2fs_emap_disk *disk;
+};
+
+/* the lower files a chunk is copied between, opened on first use */
+struct u2fs_lazy_io {
+	struct dentry *dentry;
+	struct file *dst;
+	struct file *src;
+};
+
+static struct u2fs_emap *u2fs_emap_alloc(loff_t size, unsigned int shift)
+{
+	struct u2fs_emap *emap;
+	size_t bytes;
+
+	emap = kzalloc(sizeof(*emap), GFP_KERNEL);
+	if (!emap)
+		return NULL;
+	emap->shift = shift;
+	emap->size = size;
+	emap->nchunks = (size + (1ULL << shift) - 1) >> shift;
+	bytes = DIV_ROUND_UP(emap->nchunks, 8);
+	emap->disk_len = sizeof(struct u2fs_emap_disk) + bytes;
+	/* test_bit_le works on whole longs */
+	emap->disk = kzalloc(sizeof(struct u2fs_emap_disk) +
+			     BITS_TO_LONGS(emap->nchunks) * sizeof(long),
+			     GFP_KERNEL);
+	if (!emap->disk) {
+		kfree(emap);
+		return NULL;
+	}
+	emap->disk->magic = cpu_to_le32(U2FS_EMAP_MAGIC);
+	emap->disk->shift = cpu_to_le32(shift);
+	emap->disk->size = cpu_to_le64(size);
+	emap->left = emap->nchunks;
+	mutex_init(&emap->lock);
+	return emap;
+}
+
+static void u2fs_emap_free(struct u2fs_emap *emap)
+{
+	if (!emap)
+		return;
+	kfree(emap->disk);
+	kfree(emap);
+}
+
+/* the smallest chunk size that keeps the map of @size in the xattr */
+static unsigned int u2fs_emap_shift(loff_t size)
+{
+	unsigned int shift = U2FS_EMAP_MINSHIFT;
+
+	while ((size >> shift) >= U2FS_EMAP_MAXCHUNKS)
+		shift++;
+	return shift;
+}
+
+/* write @emap to the shadow @lower_path, or remove it once complete */
+static int u2fs_emap_store(struct super_block *sb, struct path *lower_path,
+			   struct u2fs_emap *emap)
+{
+	const struct cred *old_cred;
+	int err;
+
+	err = mnt_want_write(lower_path->mnt);
+	if (err)
+		return err;
+	old_cred = override_creds(WRAPFS_SB(sb)->cred);
+	if (emap->left)
+		err = vfs_setxattr(lower_path->dentry, U2FS_EMAP_XATTR,
+				   emap->disk, emap->disk_len, 0);
+	else {
+		err = vfs_removexattr(lower_path->dentry, U2FS_EMAP_XATTR);
+		if (err == -ENODATA)
+			err = 0;
+	}
+	revert_creds(old_cred);
+	mnt_drop_write(lower_path->mnt);
+	return err;
+}
+
+/* read the map of the shadow @lower_dentry: NULL if it has none */
+static struct u2fs_emap *u2fs_emap_load(struct super_block *sb,
+					struct dentry *lower_dentry)
+{
+	struct u2fs_emap_disk *disk;
+	struct u2fs_emap *emap = NULL;
+	const struct cred *old_cred;
+	unsigned int shift;
+	unsigned long i;
+	loff_t size;
+	ssize_t len;
+
+	len = sizeof(*disk) + U2FS_EMAP_MAXCHUNKS / 8;
+	disk = kmalloc(len, GFP_KERNEL);
+	if (!disk)
+		return ERR_PTR(-ENOMEM);
+	old_cred = override_creds(WRAPFS_SB(sb)->cred);
+	len = vfs_getxattr(lower_dentry, U2FS_EMAP_XATTR, disk, len);
+	revert_creds(old_cred);
+	if (len == -ENODATA || len == -EOPNOTSUPP)
+		goto out;
+	if (len < 0) {
+		emap = ERR_PTR(len);
+		goto out;
+	}
+
+	shift = len >= sizeof(*disk) ? le32_to_cpu(disk->shift) : 0;
+	size = len >= sizeof(*disk) ? le64_to_cpu(disk->size) : 0;
+	if (len < sizeof(*disk) ||
+	    le32_to_cpu(disk->magic) != U2FS_EMAP_MAGIC ||
+	    size <= 0 || shift != u2fs_emap_shift(size)) {
+		emap = ERR_PTR(-EIO);
+		goto out;
+	}
+	emap = u2fs_emap_alloc(size, shift);
+	if (!emap) {
+		emap = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+	if (len != emap->disk_len) {
+		u2fs_emap_free(emap);
+		emap = ERR_PTR(-EIO);
+		goto out;
+	}
+	memcpy(emap->disk, disk, len);
+	for (i = 0; i < emap->nchunks; i++)
+		if (test_bit_le(i, emap->disk->bits))
+			emap->left--;
+out:
+	if (IS_ERR(emap))
+		printk(KERN_ERR "u2fs: bad extent map on %s (%ld)\n",
+		       lower_dentry->d_name.name, PTR_ERR(emap));
+	kfree(disk);
+	return emap;
+}
+
+/*
+ * The map of the regular file @dentry, loaded on first use.  Only files
+ * in both branches can have one.  Returns NULL if @dentry has none.
+ */
+static struct u2fs_emap *u2fs_lazy_get(struct dentry *dentry)
+{
+	struct inode *inode = dentry->d_inode;
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct u2fs_emap *emap;
+	struct path lower_path;
+
+	if (ACCESS_ONCE(info->emap_checked))
+		return ACCESS_ONCE(info->emap);
+	if (!S_ISREG(inode->i_mode) || !u2fs_has_branch(dentry, 0) ||
+	    !u2fs_has_branch(dentry, 1))
+		return NULL;
+
+	wrapfs_get_lower_path(dentry, &lower_path);
+	emap = u2fs_emap_load(dentry->d_sb, lower_path.dentry);
+	wrapfs_put_lower_path(dentry, &lower_path);
+	if (IS_ERR(emap))
+		return emap;
+
+	/* concurrent loaders read the same map: keep the first */
+	if (emap && cmpxchg(&info->emap, NULL, emap)) {
+		u2fs_emap_free(emap);
+		emap = info->emap;
+	}
+	smp_wmb();
+	info->emap_checked = 1;
+	return emap;
+}
+
+/* open the lower files of @io->dentry, as the mounter */
+static int u2fs_lazy_io_open(struct u2fs_lazy_io *io)
+{
+	const struct cred *cred = WRAPFS_SB(io->dentry->d_sb)->cred;
+	struct path lower_path;
+	struct file *file;
+
+	if (io->dst)
+		return 0;
+
+	wrapfs_get_lower_path_right(io->dentry, &lower_path);
+	file = dentry_open(lower_path.dentry, lower_path.mnt,
+			   O_RDONLY | O_LARGEFILE, cred);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	io->src = file;
+
+	wrapfs_get_lower_path(io->dentry, &lower_path);
+	file = dentry_open(lower_path.dentry, lower_path.mnt,
+			   O_WRONLY | O_LARGEFILE, cred);
+	if (IS_ERR(file)) {
+		fput(io->src);
+		io->src = NULL;
+		return PTR_ERR(file);
+	}
+	io->dst = file;
+	return 0;
+}
+
+static void u2fs_lazy_io_close(struct u2fs_lazy_io *io)
+{
+	if (io->dst)
+		fput(io->dst);
+	if (io->src)
+		fput(io->src);
+}
+
+/* copy @len bytes at @pos of the right branch file to the shadow */
+static int u2fs_emap_copy(struct u2fs_lazy_io *io, loff_t pos, loff_t len)
+{
+	loff_t copied;
+
+	if (len <= 0)
+		return 0;
+	copied = u2fs_copy_sparse(io->dst, io->src, pos, len);
+	if (copied != len)
+		return copied < 0 ? copied : -EIO;
+	u2fs_cuq_account(io->dentry->d_sb, copied);
+	return 0;
+}
+
+/*
+ * Mark chunk @chunk as being in the shadow, copying what of it is not in
+ * [@wstart, @wend) there first: the caller wrote that part itself.  The
+ * caller holds emap->lock.
+ */
+static int __u2fs_emap_fill(struct u2fs_lazy_io *io, struct u2fs_emap *emap,
+			    unsigned long chunk, loff_t wstart, loff_t wend)
+{
+	loff_t start = (loff_t)chunk << emap->shift;
+	loff_t end = min_t(loff_t, start + (1LL << emap->shift), emap->size);
+	int err;
+
+	if (test_bit_le(chunk, emap->disk->bits))
+		return 0;
+
+	err = u2fs_lazy_io_open(io);
+	if (err)
+		return err;
+	wstart = clamp(wstart, start, end);
+	wend = clamp(wend, wstart, end);
+	err = u2fs_emap_copy(io, start, wstart - start);
+	if (!err)
+		err = u2fs_emap_copy(io, wend, end - wend);
+	if (err)
+		return err;
+
+	__set_bit_le(chunk, emap->disk->bits);
+	emap->left--;
+	err = u2fs_emap_store(io->dentry->d_sb, &io->dst->f_path, emap);
+	if (err) {
+		/* a bit that is not on disk must not be trusted either */
+		__clear_bit_le(chunk, emap->disk->bits);
+		emap->left++;
+	}
+	return err;
+}
+
+/* copy chunk @chunk to the shadow, if it is not there yet */
+static int u2fs_emap_fill(struct u2fs_lazy_io *io, struct u2fs_emap *emap,
+			  unsigned long chunk)
+{
+	int err;
+
+	mutex_lock(&emap->lock);
+	err = __u2fs_emap_fill(io, emap, chunk, 0, 0);
+	mutex_unlock(&emap->lock);
+	return err;
+}
+
+/* called by ->open, after the lower files were opened */
+int u2fs_lazy_open(struct file *file)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct u2fs_emap *emap;
+	struct path lower_path;
+	struct file *lower_file;
+
+	emap = u2fs_lazy_get(dentry);
+	if (IS_ERR_OR_NULL(emap))
+		return PTR_ERR(emap);
+	if (!ACCESS_ONCE(emap->left) || wrapfs_lower_file_right(file))
+		return 0;
+
+	/*
+	 * A metadata-only copy-up of a file below the lazycopyup threshold
+	 * gets its data now, on the first open for writing, like any other
+	 * small file would have at copy-up time.
+	 */
+	if ((file->f_mode & FMODE_WRITE) && !(file->f_flags & O_TRUNC) &&
+	    (!WRAPFS_SB(dentry->d_sb)->lazy_min ||
+	     emap->size < WRAPFS_SB(dentry->d_sb)->lazy_min))
+		return u2fs_cuq_run(dentry, U2FS_CU_FINISH, 0);
+
+	/* reads of chunks not copied yet go to the right branch */
+	wrapfs_get_lower_path_right(dentry, &lower_path);
+	lower_file = dentry_open(lower_path.dentry, lower_path.mnt,
+				 O_RDONLY | O_LARGEFILE, file->f_cred);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
+	wrapfs_set_lower_file(file, lower_file, 1);
+	return 0;
+}
+
+/* the read part of wrapfs_read, for files with a map */
+ssize_t u2fs_lazy_read(struct file *file, char __user *buf, size_t count,
+		       loff_t *ppos)
+{
+	struct u2fs_emap *emap = WRAPFS_I(file->f_path.dentry->d_inode)->emap;
+	struct file *left = wrapfs_lower_file(file);
+	struct file *right = wrapfs_lower_file_right(file);
+	struct file *lower_file;
+	loff_t pos = *ppos, end;
+	unsigned long chunk;
+	ssize_t done = 0, n = 0;
+	size_t len;
+
+	while (count) {
+		chunk = pos >> emap->shift;
+		end = (loff_t)(chunk + 1) << emap->shift;
+		lower_file = left;
+		if (right && pos < emap->size &&
+		    !test_bit_le(chunk, emap->disk->bits)) {
+			lower_file = right;
+			/* the shadow may have been truncated meanwhile */
+			end = min3(end, emap->size,
+				   i_size_read(left->f_path.dentry->d_inode));
+		}
+		len = min_t(loff_t, count, max_t(loff_t, end - pos, 0));
+		n = vfs_read(lower_file, buf, len, &pos);
+		if (n <= 0)
+			break;
+		done += n;
+		buf += n;
+		count -= n;
+		if (n < len)
+			break;
+	}
+
+	*ppos = pos;
+	return done ? done : n;
+}
+
+/*
+ * SEEK_DATA and SEEK_HOLE of a file with a map: every chunk asks the
+ * branch its data is in.  Returns -EINVAL if a branch cannot tell.
+ */
+loff_t u2fs_lazy_llseek(struct file *file, loff_t offset, int origin)
+{
+	struct u2fs_emap *emap = WRAPFS_I(file->f_path.dentry->d_inode)->emap;
+	loff_t size = i_size_read(file->f_path.dentry->d_inode);
+	struct file *left = wrapfs_lower_file(file);
+	struct file *right = wrapfs_lower_file_right(file);
+	struct file *lower_file;
+	unsigned long chunk;
+	loff_t end, pos;
+
+	if (offset < 0 || offset >= size)
+		return -ENXIO;
+
+	while (offset < size) {
+		chunk = offset >> emap->shift;
+		end = min((loff_t)(chunk + 1) << emap->shift, size);
+		lower_file = left;
+		if (right && offset < emap->size &&
+		    !test_bit_le(chunk, emap->disk->bits)) {
+			lower_file = right;
+			end = min(end, emap->size);
+		}
+		pos = vfs_llseek(lower_file, offset, origin);
+		if (pos >= 0 && pos < end)
+			return pos;
+		if (pos < 0 && pos != -ENXIO)
+			return pos;
+		offset = end;
+	}
+	/* the end of the file is a hole */
+	return origin == SEEK_HOLE ? size : -ENXIO;
+}
+
+/*
+ * The write part of wrapfs_write, for files with a map.  The chunks the
+ * write only partly covers are copied first.  Those it covers whole are
+ * marked after it, as far as it got.
+ */
+ssize_t u2fs_lazy_write(struct file *file, const char __user *buf,
+			size_t count, loff_t *ppos)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct u2fs_lazy_io io = { .dentry = dentry };
+	struct u2fs_emap *emap = WRAPFS_I(dentry->d_inode)->emap;
+	struct file *lower_file = wrapfs_lower_file(file);
+	loff_t pos = *ppos, end, start;
+	unsigned long chunk;
+	ssize_t n;
+	int err = 0;
+
+	mutex_lock(&emap->lock);
+	if (!emap->left) {
+		mutex_unlock(&emap->lock);
+		return vfs_write(lower_file, buf, count, ppos);
+	}
+
+	if (file->f_flags & O_APPEND)
+		pos = i_size_read(lower_file->f_path.dentry->d_inode);
+	end = min_t(loff_t, pos + count, emap->size);
+	for (chunk = pos >> emap->shift; !err; chunk++) {
+		start = (loff_t)chunk << emap->shift;
+		if (start >= end)
+			break;
+		if (pos > start ||
+		    end < min(start + (1LL << emap->shift), emap->size))
+			err = __u2fs_emap_fill(&io, emap, chunk, 0, 0);
+	}
+	if (err) {
+		n = err;
+		goto out;
+	}
+
+	n = vfs_write(lower_file, buf, count, ppos);
+	if (n <= 0)
+		goto out;
+
+	/* the write ended at *ppos, wherever O_APPEND put it */
+	start = *ppos - n;
+	end = min_t(loff_t, *ppos, emap->size);
+	for (chunk = start >> emap->shift; !err; chunk++) {
+		if ((loff_t)chunk << emap->shift >= end)
+			break;
+		err = __u2fs_emap_fill(&io, emap, chunk, start, *ppos);
+	}
+	/* data the map does not point to is not written as far as we know */
+	if (err)
+		n = err;
+out:
+	mutex_unlock(&emap->lock);
+	u2fs_lazy_io_close(&io);
+	return n;
+}
+
+/*
+ * Called before @dentry is truncated to @size, with u2fs_lazy_truncate_end
+ * after it.  The chunk the new end cuts is copied first.  If @dentry has
+ * a map, it stays locked in between.
+ */
+int u2fs_lazy_truncate(struct dentry *dentry, loff_t size)
+{
+	struct u2fs_lazy_io io = { .dentry = dentry };
+	struct u2fs_emap *emap;
+	int err = 0;
+
+	emap = u2fs_lazy_get(dentry);
+	if (IS_ERR_OR_NULL(emap))
+		return PTR_ERR(emap);
+
+	mutex_lock(&emap->lock);
+	if (emap->left && size < emap->size &&
+	    (size & ((1LL << emap->shift) - 1)))
+		err = __u2fs_emap_fill(&io, emap, size >> emap->shift, 0, 0);
+	u2fs_lazy_io_close(&io);
+	if (err)
+		mutex_unlock(&emap->lock);
+	return err;
+}
+
+/*
+ * Called after @dentry was truncated to @size, or failed to be with
+ * @err.  Once the shadow is cut, the chunks past its end read as zeroes
+ * from it.  Returns @err, or the error of marking them.
+ */
+int u2fs_lazy_truncate_end(struct dentry *dentry, loff_t size, int err)
+{
+	struct u2fs_lazy_io io = { .dentry = dentry };
+	struct u2fs_emap *emap = WRAPFS_I(dentry->d_inode)->emap;
+	struct u2fs_emap_disk *saved = NULL;
+	unsigned long chunk, first, dropped = 0;
+
+	if (!emap)
+		return err;
+	if (err || !emap->left || size >= emap->size)
+		goto out;
+
+	saved = kmemdup(emap->disk, emap->disk_len, GFP_KERNEL);
+	if (!saved) {
+		err = -ENOMEM;
+		goto out;
+	}
+	first = (size + (1LL << emap->shift) - 1) >> emap->shift;
+	for (chunk = first; chunk < emap->nchunks; chunk++)
+		if (!__test_and_set_bit_le(chunk, emap->disk->bits))
+			dropped++;
+	if (!dropped)
+		goto out;
+	emap->left -= dropped;
+	err = u2fs_lazy_io_open(&io);
+	if (!err)
+		err = u2fs_emap_store(dentry->d_sb, &io.dst->f_path, emap);
+	if (err) {
+		memcpy(emap->disk, saved, emap->disk_len);
+		emap->left += dropped;
+	}
+out:
+	mutex_unlock(&emap->lock);
+	kfree(saved);
+	u2fs_lazy_io_close(&io);
+	return err;
+}
+
+/*
+ * Copy the chunks of @dentry that [@pos, @pos + @len) touches and that
+ * are still in the right branch only.  Called before splice, which hands
+ * the pages of the shadow over.
+ */
+int u2fs_lazy_fill(struct dentry *dentry, loff_t pos, size_t len)
+{
+	struct u2fs_lazy_io io = { .dentry = dentry };
+	struct u2fs_emap *emap;
+	unsigned long chunk;
+	loff_t end;
+	int err = 0;
+
+	emap = u2fs_lazy_get(dentry);
+	if (IS_ERR_OR_NULL(emap))
+		return PTR_ERR(emap);
+	if (pos < 0 || pos >= emap->size)
+		return 0;
+
+	end = pos + min_t(loff_t, len, emap->size - pos);
+	for (chunk = pos >> emap->shift; !err && ACCESS_ONCE(emap->left) &&
+		     ((loff_t)chunk << emap->shift) < end; chunk++)
+		err = u2fs_emap_fill(&io, emap, chunk);
+	u2fs_lazy_io_close(&io);
+	return err;
+}
+
+/*
+ * Copy whatever of @dentry is still in the right branch only.  Called
+ * before anything that uses the shadow directly, like mmap, and by the
+ * copy-up workers.
+ */
+int u2fs_lazy_finish(struct dentry *dentry)
+{
+	struct u2fs_lazy_io io = { .dentry = dentry };
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(dentry->d_sb);
+	struct u2fs_emap *emap;
+	unsigned long chunk;
+	int err = 0;
+
+	emap = u2fs_lazy_get(dentry);
+	if (IS_ERR_OR_NULL(emap))
+		return PTR_ERR(emap);
+
+	for (chunk = 0; !err && ACCESS_ONCE(emap->left) &&
+		     chunk < emap->nchunks; chunk++) {
+		err = u2fs_emap_fill(&io, emap, chunk);
+		if (!err && (fatal_signal_pending(current) ||
+			     test_bit(U2FS_SB_DYING, &sbi->state)))
+			err = -EINTR;
+		cond_resched();
+	}
+	u2fs_lazy_io_close(&io);
+	return err;
+}
+
+/* called by ->release: the last writer leaves the rest to a worker */
+void u2fs_lazy_release(struct file *file)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct u2fs_emap *emap = WRAPFS_I(dentry->d_inode)->emap;
+
+	if (!emap || !ACCESS_ONCE(emap->left) ||
+	    !(file->f_mode & FMODE_WRITE) ||
+	    atomic_read(&dentry->d_inode->i_writecount) > 1)
+		return;
+
+	u2fs_cuq_queue(dentry, U2FS_CU_FINISH);
+}
+
+/*
+ * Called by u2fs_copyup_file instead of copying the data: makes the new
+ * left branch file @tmp_path a shadow of a @size bytes right branch file.
+ */
+int u2fs_lazy_create(struct super_block *sb, struct path *tmp_path,
+		     loff_t size)
+{
+	struct dentry *tmp_dentry = tmp_path->dentry;
+	struct u2fs_emap *emap;
+	struct iattr ia;
+	int err;
+
+	emap = u2fs_emap_alloc(size, u2fs_emap_shift(size));
+	if (!emap)
+		return -ENOMEM;
+
+	ia.ia_valid = ATTR_SIZE;
+	ia.ia_size = size;
+	mutex_lock(&tmp_dentry->d_inode->i_mutex);
+	err = notify_change(tmp_dentry, &ia);
+	mutex_unlock(&tmp_dentry->d_inode->i_mutex);
+	if (!err)
+		err = u2fs_emap_store(sb, tmp_path, emap);
+
+	u2fs_emap_free(emap);
+	return err;
+}
+
+/* called when @inode is evicted */
+void u2fs_lazy_free(struct inode *inode)
+{
+	u2fs_emap_free(WRAPFS_I(inode)->emap);
+	WRAPFS_I(inode)->emap = NULL;
+}
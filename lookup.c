@@ -10,6 +10,7 @@
  */
 
 #include "wrapfs.h"
+#include <linux/llist.h>
 
 /* The dentry cache is just so we have properly sized dentries */
 static struct kmem_cache *wrapfs_dentry_cachep;
@@ -26,16 +27,89 @@ int wrapfs_init_dentry_cache(void)
 
 void wrapfs_destroy_dentry_cache(void)
 {
+	/* wait for pending free_dentry_private_data callbacks */
+	rcu_barrier();
+	u2fs_path_put_flush();
 	if (wrapfs_dentry_cachep)
 		kmem_cache_destroy(wrapfs_dentry_cachep);
 }
 
+static void wrapfs_free_dentry_info_rcu(struct rcu_head *head)
+{
+	struct wrapfs_dentry_info *info =
+		container_of(head, struct wrapfs_dentry_info, rcu);
+
+	kmem_cache_free(wrapfs_dentry_cachep, info);
+}
+
+/* RCU-walk may still be looking at the private data, see d_revalidate */
 void free_dentry_private_data(struct dentry *dentry)
 {
+	struct wrapfs_dentry_info *info;
+
 	if (!dentry || !dentry->d_fsdata)
 		return;
-	kmem_cache_free(wrapfs_dentry_cachep, dentry->d_fsdata);
+	info = WRAPFS_D(dentry);
 	dentry->d_fsdata = NULL;
+	call_rcu(&info->rcu, wrapfs_free_dentry_info_rcu);
+}
+
+/*
+ * Lower paths dropped from a live dentry, which lockless readers may have
+ * just copied, see __wrapfs_get_lower_path.  Their references are put
+ * after a grace period, by a work item, since dput may sleep.
+ */
+struct u2fs_rcu_path {
+	struct rcu_head rcu;
+	struct llist_node node;
+	struct path path;
+};
+
+static LLIST_HEAD(u2fs_rcu_paths);
+
+static void u2fs_path_put_work_fn(struct work_struct *work)
+{
+	struct llist_node *node = llist_del_all(&u2fs_rcu_paths);
+	struct u2fs_rcu_path *p;
+
+	while (node) {
+		p = llist_entry(node, struct u2fs_rcu_path, node);
+		node = node->next;
+		path_put(&p->path);
+		kfree(p);
+	}
+}
+
+static DECLARE_WORK(u2fs_path_put_work, u2fs_path_put_work_fn);
+
+static void u2fs_path_put_rcu_fn(struct rcu_head *head)
+{
+	struct u2fs_rcu_path *p = container_of(head, struct u2fs_rcu_path, rcu);
+
+	llist_add(&p->node, &u2fs_rcu_paths);
+	schedule_work(&u2fs_path_put_work);
+}
+
+/* put @path once lockless readers are done with it, without waiting */
+void u2fs_path_put_rcu(struct path *path)
+{
+	struct u2fs_rcu_path *p;
+
+	p = kmalloc(sizeof(*p), GFP_KERNEL);
+	if (!p) {
+		synchronize_rcu();
+		path_put(path);
+		return;
+	}
+	pathcpy(&p->path, path);
+	call_rcu(&p->rcu, u2fs_path_put_rcu_fn);
+}
+
+/* wait until all paths passed to u2fs_path_put_rcu have been put */
+void u2fs_path_put_flush(void)
+{
+	rcu_barrier();
+	flush_work(&u2fs_path_put_work);
 }
 
 /* allocate new dentry private data */
@@ -53,78 +127,118 @@ int new_dentry_private_data(struct dentry *dentry)
 	info->lower_path_right.mnt=NULL;
 	info->lower_path.mnt=NULL;
 	spin_lock_init(&info->lock);
+	seqcount_init(&info->seq);
 	dentry->d_fsdata = info;
 
 	return 0;
 }
 
-static int wrapfs_inode_test(struct inode *inode, void *candidate_lower_inode)
+/*
+ * A u2fs inode is identified by the lower inode of its topmost branch:
+ * the left one if it has one, the right one otherwise.  Looking the same
+ * lower object up twice, or through a hard link, yields the same u2fs
+ * inode, and its inode number stays stable (see u2fs_ino).
+ */
+struct u2fs_inode_key {
+	struct inode *lower_inode;
+	int bindex;
+};
+
+static int wrapfs_inode_test(struct inode *inode, void *data)
 {
+	struct u2fs_inode_key *key = data;
 	struct inode *current_lower_inode = wrapfs_lower_inode(inode);
-	if (current_lower_inode == (struct inode *)candidate_lower_inode)
+
+	if (!current_lower_inode)
+		current_lower_inode = wrapfs_lower_inode_right(inode);
+	if (current_lower_inode == key->lower_inode)
 		return 1; /* found a match */
 	else
 		return 0; /* no match */
 }
 
-static int wrapfs_inode_set(struct inode *inode, void *lower_inode)
+static int wrapfs_inode_set(struct inode *inode, void *data)
 {
-	/* we do actual inode initialization in wrapfs_iget */
+	struct u2fs_inode_key *key = data;
+
+	/*
+	 * Record the key so that concurrent lookups match this I_NEW inode.
+	 * The reference is taken, and everything else is initialized, in
+	 * u2fs_iget.
+	 */
+	wrapfs_set_lower_inode(inode, key->lower_inode, key->bindex);
 	return 0;
 }
 
-struct inode *wrapfs_iget(struct super_block *sb, struct inode *lower_inode)
+/*
+ * Find or create the u2fs inode on top of @lower_inode (left branch) and
+ * @lower_inode_right (right branch); either may be NULL, but not both.
+ */
+struct inode *u2fs_iget(struct super_block *sb, struct inode *lower_inode,
+			struct inode *lower_inode_right)
 {
-	struct wrapfs_inode_info *info;
+	struct u2fs_inode_key key;
 	struct inode *inode; /* the new inode to return */
-	int err;
+	struct inode *lnode;
+
+	key.bindex = lower_inode ? 0 : 1;
+	key.lower_inode = lower_inode ? lower_inode : lower_inode_right;
+	if (!key.lower_inode)
+		return ERR_PTR(-ENOENT);
 
 	inode = iget5_locked(sb, /* our superblock */
-			     /*
-			      * hashval: we use inode number, but we can
-			      * also use "(unsigned long)lower_inode"
-			      * instead.
-			      */
-			     lower_inode->i_ino, /* hashval */
+			     key.lower_inode->i_ino, /* hashval */
 			     wrapfs_inode_test,	/* inode comparison function */
 			     wrapfs_inode_set, /* inode init function */
-			     lower_inode); /* data passed to test+set fxns */
-	if (!inode) {
-		err = -EACCES;
-		iput(lower_inode);
-		return ERR_PTR(err);
-	}
-	/* if found a cached inode, then just return it */
-	if (!(inode->i_state & I_NEW))
+			     &key); /* data passed to test+set fxns */
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	/*
+	 * If found a cached inode, it may have sat unused for a while:
+	 * refresh its attributes before returning it.
+	 */
+	if (!(inode->i_state & I_NEW)) {
+		lnode = u2fs_lower_inode_top(inode);
+		fsstack_copy_attr_all(inode, lnode);
+		u2fs_copy_inode_size(inode, lnode);
 		return inode;
+	}
 
 	/* initialize new inode */
-	info = WRAPFS_I(inode);
-
-	inode->i_ino = lower_inode->i_ino;
-	if (!igrab(lower_inode)) {
-		err = -ESTALE;
-		return ERR_PTR(err);
+	lnode = key.lower_inode;
+	if (!igrab(lnode)) {
+		/* evict_inode must not drop a reference we never took */
+		wrapfs_set_lower_inode(inode, NULL, key.bindex);
+		iget_failed(inode);
+		return ERR_PTR(-ESTALE);
 	}
-	wrapfs_set_lower_inode(inode, lower_inode,0);
+	if (key.bindex == 0 && lower_inode_right)
+		wrapfs_set_lower_inode(inode, igrab(lower_inode_right), 1);
 
+	inode->i_ino = u2fs_ino(lnode, key.bindex);
 	inode->i_version++;
 
 	/* use different set of inode ops for symlinks & directories */
-	if (S_ISDIR(lower_inode->i_mode))
+	if (S_ISDIR(lnode->i_mode))
 		inode->i_op = &wrapfs_dir_iops;
-	else if (S_ISLNK(lower_inode->i_mode))
+	else if (S_ISLNK(lnode->i_mode))
 		inode->i_op = &wrapfs_symlink_iops;
 	else
 		inode->i_op = &wrapfs_main_iops;
 
 	/* use different set of file ops for directories */
-	if (S_ISDIR(lower_inode->i_mode))
+	if (S_ISDIR(lnode->i_mode))
 		inode->i_fop = &wrapfs_dir_fops;
+	else if (S_ISREG(lnode->i_mode) &&
+		 (WRAPFS_SB(sb)->flags & U2FS_MNT_PAGECACHE))
+		inode->i_fop = &u2fs_pc_fops;
 	else
 		inode->i_fop = &wrapfs_main_fops;
 
-	inode->i_mapping->a_ops = &wrapfs_aops;
+	if (inode->i_fop == &u2fs_pc_fops)
+		inode->i_mapping->a_ops = &u2fs_pc_aops;
+	else
+		inode->i_mapping->a_ops = &wrapfs_aops;
 
 	inode->i_atime.tv_sec = 0;
 	inode->i_atime.tv_nsec = 0;
@@ -134,119 +248,18 @@ struct inode *wrapfs_iget(struct super_block *sb, struct inode *lower_inode)
 	inode->i_ctime.tv_nsec = 0;
 
 	/* properly initialize special inodes */
-	if (S_ISBLK(lower_inode->i_mode) || S_ISCHR(lower_inode->i_mode) ||
-	    S_ISFIFO(lower_inode->i_mode) || S_ISSOCK(lower_inode->i_mode))
-		init_special_inode(inode, lower_inode->i_mode,
-				   lower_inode->i_rdev);
+	if (S_ISBLK(lnode->i_mode) || S_ISCHR(lnode->i_mode) ||
+	    S_ISFIFO(lnode->i_mode) || S_ISSOCK(lnode->i_mode))
+		init_special_inode(inode, lnode->i_mode, lnode->i_rdev);
 
 	/* all well, copy inode attributes */
-	fsstack_copy_attr_all(inode, lower_inode);
-	fsstack_copy_inode_size(inode, lower_inode);
+	fsstack_copy_attr_all(inode, lnode);
+	fsstack_copy_inode_size(inode, lnode);
 
 	unlock_new_inode(inode);
 	return inode;
 }
 
-struct inode *u2fs_iget(struct super_block *sb){
-
-	struct wrapfs_inode_info *info;
-	struct inode *inode;
-	
-	unsigned long ino=iunique(sb,WRAPFS_ROOT_INO);
-	
-
-	inode=iget_locked(sb,ino);
-	if(!inode)
-		return ERR_PTR(-ENOMEM);
-	if(!(inode->i_state & I_NEW))
-		return inode;
-	
-	info=WRAPFS_I(inode);
-
-	inode->i_version++;
-	inode->i_op=&wrapfs_main_iops;
-
-	inode->i_fop=&wrapfs_main_fops;
-
-
-	inode->i_mapping->a_ops=&wrapfs_aops;
-
-	inode->i_atime.tv_sec=inode->i_atime.tv_nsec=0;
-	inode->i_mtime.tv_sec=inode->i_mtime.tv_nsec=0;
-	inode->i_ctime.tv_sec=inode->i_ctime.tv_nsec=0;
-
-	
-	unlock_new_inode(inode);
-	return inode;
-
-}
-
-
-int u2fs_fill_inode(struct dentry *dentry, struct inode *inode){
-
-	struct inode *lnode;
-	struct dentry *lower_dentry;
-	int i=0;
-	printk("The root name is %s\n",dentry->d_name.name);
-
-	for(i=0;i<2;i++){
-		lower_dentry=wrapfs_get_lower_dentry_idx(dentry,i);	
-		
-		if(!lower_dentry){
-			printk("No lower dentry u2fs at branch %d\n",i);
-			wrapfs_set_lower_inode(inode,NULL,i);
-			continue;
-		}
-		if(!lower_dentry->d_inode){
-			printk("No lower inode u2fs\n");
-			continue;
-		}
-		printk("inode num  %lu\n",lower_dentry->d_inode->i_ino);	
-		wrapfs_set_lower_inode(inode,igrab(lower_dentry->d_inode),i);
-			
-		
-			
-	}
-
-	//printk("The inode number for left inode is %lu and right inode is %lu\n",wrapfs_lower_inode(inode)->i_ino,
-	//wrapfs_lower_inode_right(inode)->i_ino);
-
-	lnode=wrapfs_lower_inode(inode);
-
-	
-	if(!lnode){
-		printk("Could not find in the left branch\n");
-		lnode=wrapfs_lower_inode_right(inode);
-		if(!lnode){
-			printk("There is some serious error\n");
-			return -ENOENT;
-		}
-	}
-	
-	if(S_ISLNK(lnode->i_mode))
-                inode->i_op=&wrapfs_symlink_iops;
-        else if (S_ISDIR(lnode->i_mode))
-                inode->i_op=&wrapfs_dir_iops;
-        else
-                inode->i_op=&wrapfs_main_iops;
-
-        if(S_ISDIR(lnode->i_mode))
-                inode->i_fop=&wrapfs_dir_fops;
-        else
-                inode->i_fop=&wrapfs_main_fops;
-
-	if (S_ISBLK(lnode->i_mode) || S_ISCHR(lnode->i_mode) ||
-            S_ISFIFO(lnode->i_mode) || S_ISSOCK(lnode->i_mode))
-                init_special_inode(inode, lnode->i_mode,
-                                   lnode->i_rdev);
-
-        /* all well, copy inode attributes */
-        fsstack_copy_attr_all(inode, lnode);
-        fsstack_copy_inode_size(inode, lnode);
-
-	return 0;	
-}
-
 
 
 /*
@@ -274,37 +287,56 @@ int wrapfs_interpose(struct dentry *dentry, struct super_block *sb,
 		goto out;
 	}
 
+	/* a new object only exists in the left branch */
+	wrapfs_put_reset_lower_path_right(dentry);
+	u2fs_set_branches(dentry, U2FS_BR_LEFT);
+
 	/*
-	 * We allocate our new inode below by calling wrapfs_iget,
+	 * We allocate our new inode below by calling u2fs_iget,
 	 * which will initialize some of the new inode's fields
 	 */
 
 	/* inherit lower inode number for wrapfs's inode */
-	inode = wrapfs_iget(sb, lower_inode);
+	inode = u2fs_iget(sb, lower_inode, NULL);
 	if (IS_ERR(inode)) {
 		err = PTR_ERR(inode);
 		goto out;
 	}
 
-	d_add(dentry, inode);
+	if (d_unhashed(dentry))
+		d_add(dentry, inode);
+	else
+		d_instantiate(dentry, inode);
 
 out:
 	return err;
 }
 
+/* instantiate @dent with the u2fs inode on top of its lower dentries */
 int u2fs_interpose(struct dentry *dent, struct super_block *sb){
 	int err=0;
 	struct inode *inode;
-	
-	inode=u2fs_iget(sb);
+	struct dentry *lower_dentry;
+	struct inode *lower_inode[MAX_BRANCHES];
+	int i;
+
+	for(i=0;i<MAX_BRANCHES;i++){
+		lower_dentry=wrapfs_get_lower_dentry_idx(dent,i);
+		lower_inode[i]=lower_dentry ? lower_dentry->d_inode : NULL;
+	}
+
+	inode=u2fs_iget(sb,lower_inode[0],lower_inode[1]);
 
 	if(IS_ERR(inode)){
 		err=PTR_ERR(inode);
 		goto out;
 	}	
 
-	err=u2fs_fill_inode(dent,inode);
-	d_add(dent,inode);
+	/* creates instantiate the negative dentry lookup already hashed */
+	if(d_unhashed(dent))
+		d_add(dent,inode);
+	else
+		d_instantiate(dent,inode);
 	
 
 out:
@@ -312,44 +344,79 @@ out:
 }
 
 
+/*
+ * Look @name up in branch @bindex of the directory @parent.
+ *
+ * Returns: 0 and a referenced @lower_path if the name exists there,
+ * -ENOENT if not, -ERRNO on other errors.
+ */
+static int u2fs_lookup_branch(struct dentry *parent, int bindex,
+			      const char *name, struct path *lower_path)
+{
+	struct path lower_parent_path;
+	int err = -ENOENT;
 
-struct dentry *lookup_whiteout(const char *name, struct dentry *lower_parent){
-
-	char *whname;
-	int err=0,namelen,tlen;
-	struct dentry *wh_dentry;
-	struct dentry *d;	
-
-	namelen=strlen(name);
-
-	printk("In the lookup whiteout the parent %s\n",lower_parent->d_name.name);
-	
-	whname=alloc_whname(name,lower_parent->d_name.name,namelen,lower_parent->d_name.len);
-	tlen=namelen+lower_parent->d_name.len+U2FS_WHLEN+1;
-
-	printk("In lookup whiteout func the whname is %s\n",whname);
-
-	d=create_parents(lower_parent->d_inode,lower_parent,lower_parent->d_name.name);
-
-	wh_dentry=lookup_one_len(whname,d,tlen);
-	if(IS_ERR(wh_dentry)){
-		err=PTR_ERR(wh_dentry);
-		goto out;
-
-	}
+	if (bindex == 0)
+		wrapfs_get_lower_path(parent, &lower_parent_path);
+	else
+		wrapfs_get_lower_path_right(parent, &lower_parent_path);
+	if (lower_parent_path.dentry && lower_parent_path.dentry->d_inode)
+		err = vfs_path_lookup(lower_parent_path.dentry,
+				      lower_parent_path.mnt, name, 0,
+				      lower_path);
+	wrapfs_put_lower_path(parent, &lower_parent_path);
+	return err;
+}
 
-	if(!wh_dentry->d_inode)
-		goto out;
+/*
+ * Parallel lookups (the "parlookup" mount option).  The right branch
+ * lookup of a name is handed to a worker, running with the caller's
+ * credentials, while the caller checks the whiteouts and the left
+ * branch.  Both the parent dentry and the name are stable until the
+ * worker is joined: the VFS holds the parent's i_mutex and we hold a
+ * reference on it.
+ */
+struct u2fs_lookup_work {
+	struct work_struct work;
+	struct dentry *parent;
+	const char *name;
+	const struct cred *cred;
+	struct path lower_path;
+	int err;
+};
 
+static void u2fs_lookup_work_fn(struct work_struct *work)
+{
+	struct u2fs_lookup_work *lw =
+		container_of(work, struct u2fs_lookup_work, work);
+	const struct cred *old_cred;
 
-out:
-	kfree(whname);
-	if(err)
-		wh_dentry=ERR_PTR(err);
-	return wh_dentry;
+	old_cred = override_creds(lw->cred);
+	lw->err = u2fs_lookup_branch(lw->parent, 1, lw->name, &lw->lower_path);
+	revert_creds(old_cred);
+}
 
+static void u2fs_lookup_start(struct u2fs_lookup_work *lw,
+			      struct dentry *parent, const char *name)
+{
+	INIT_WORK_ONSTACK(&lw->work, u2fs_lookup_work_fn);
+	lw->parent = parent;
+	lw->name = name;
+	lw->cred = get_current_cred();
+	queue_work(system_unbound_wq, &lw->work);
 }
 
+/* wait for the right branch lookup; same results as u2fs_lookup_branch */
+static int u2fs_lookup_join(struct u2fs_lookup_work *lw,
+			    struct path *lower_path)
+{
+	flush_work(&lw->work);
+	destroy_work_on_stack(&lw->work);
+	put_cred(lw->cred);
+	if (!lw->err)
+		pathcpy(lower_path, &lw->lower_path);
+	return lw->err;
+}
 
 /*
  * Main driver function for wrapfs's lookup.
@@ -364,15 +431,16 @@ static struct dentry *__wrapfs_lookup(struct dentry *dentry, int flags,
 	struct vfsmount *lower_dir_mnt;
 	struct dentry *lower_dir_dentry;
 	struct dentry *lower_dentry;
-	struct dentry *lower_wh_dentry;
 	const char *name;
 	struct path lower_parent_path,lower_path;
-	struct qstr this;
+	struct u2fs_lookup_work lw, *plw = NULL;
 	int i;
 	int num_positives=0;
 
 
 	lower_dir_dentry=NULL;
+	lower_parent_path.dentry=NULL;
+	lower_parent_path.mnt=NULL;
 
 	/* must initialize dentry operations */
 	d_set_d_op(dentry, &wrapfs_dops);
@@ -380,153 +448,112 @@ static struct dentry *__wrapfs_lookup(struct dentry *dentry, int flags,
 	if (IS_ROOT(dentry))
 		goto out;
 	
-	name = dentry->d_name.name;
-	
-	printk("made it to the for loop and the name is %s\n",name);
-	
-	for(i=0;i<2;i++){
-		if(i==0){
-			wrapfs_get_lower_path(parent,&lower_parent_path);
-			// printk("The left path name is %s\n",lower_parent_path.dentry->d_name.name);
-		}
-		if(i==1){
-			wrapfs_get_lower_path_right(parent,&lower_parent_path);
-			//printk("The right path name is %s\n",lower_parent_path.dentry->d_name.name);
-		}
-		/* now start the actual lookup procedure */
-		if(!lower_parent_path.dentry){
-			printk("No lower parent dentry found in this branch %d\n",i);
-			wrapfs_put_lower_path(parent,&lower_parent_path);
-			continue;
-		}		
+	name = (const char *)dentry->d_name.name;
 
-		printk("The path name is %s on branch %d\n",lower_parent_path.dentry->d_name.name,i);
-		
-			
-		lower_wh_dentry=lookup_whiteout(name,parent);
-
-		if(IS_ERR(lower_wh_dentry)){
-			err=PTR_ERR(lower_wh_dentry);
-			printk("Lookup white out error %d\n",err);	
-		}
-	
-		if(!IS_ERR(lower_wh_dentry)){	
-			if(lower_wh_dentry->d_inode){
-				printk("In wrapfs lookup the lower white out exists\n");
-				dput(lower_wh_dentry);
-				break;
-
-			}
-			dput(lower_wh_dentry);
-		}	
-		
-	
+	/* names with the whiteout prefix belong to u2fs itself */
+	if (u2fs_is_whname(&dentry->d_name)) {
+		err = -EPERM;
+		goto out;
+	}
 
+	/* let a worker search the right branch while we do the left one */
+	if ((WRAPFS_SB(dentry->d_sb)->flags & U2FS_MNT_PARLOOKUP) &&
+	    u2fs_has_branch(parent, 0) && u2fs_has_branch(parent, 1)) {
+		u2fs_lookup_start(&lw, parent, name);
+		plw = &lw;
+	}
 
-		lower_dir_dentry = lower_parent_path.dentry;
-		lower_dir_mnt = lower_parent_path.mnt;
-		printk("in wrapfs lookup, this is not the problem\n");
+	/*
+	 * A whiteout hides the name in every branch.  Whiteouts live in the
+	 * left branch, so a directory that only exists in the right branch
+	 * has none.
+	 */
+	if (u2fs_has_branch(parent, 0)) {
+		err = u2fs_wh_lookup(parent, &dentry->d_name);
+		if (err < 0)
+			goto out;
+	}
 
-		
-		if(!lower_dir_dentry||!lower_dir_dentry->d_inode){
+	for(i=0;i<2 && !err;i++){
+		/* only branches the parent exists in can hold the name */
+		if(!u2fs_has_branch(parent,i))
 			continue;
+		if(i==1 && plw){
+			err=u2fs_lookup_join(plw,&lower_path);
+			plw=NULL;
 		}
-		
-		/* Use vfs_path_lookup to check if the dentry exists or not */
-		err = vfs_path_lookup(lower_dir_dentry, lower_dir_mnt, name, 0,
-			     	 &lower_path);
-
-		//printk("in wrapfs lookup this could be the problem\n");
+		else
+			err=u2fs_lookup_branch(parent,i,name,&lower_path);
 
 		if(err && err!=-ENOENT){
-			printk("Error in u2fs lookup and errno is blah %d\n",err);
 			goto out;
 		}
-		printk("This is for sanity check and err is %d\n",err);
 		if(err==0){		
-			if(i==0){
-				printk("The lower path dentry name is %s",lower_path.dentry->d_name.name);
+			if(i==0)
 				wrapfs_set_lower_path(dentry,&lower_path);
-				printk("In wrapfs lookup setting path for left path\n");
-			}
-
-			if(i==1){
+			if(i==1)
 				wrapfs_set_lower_path_right(dentry,&lower_path);
-				printk("In wrapfs lookup setting path for right\n");
-			}
-
+			u2fs_set_branches(dentry,1<<i);
 			num_positives++;
 		}
-		//wrapfs_put_lower_path(parent,&lower_parent_path);		
+		err=0;
+
+		/* an opaque left directory hides the right branch one */
+		if(i==0 && num_positives &&
+		   S_ISDIR(lower_path.dentry->d_inode->i_mode) &&
+		   u2fs_has_branch(parent,1)){
+			err=u2fs_is_opaque(lower_path.dentry);
+			if(err<0)
+				goto out;
+			WRAPFS_D(dentry)->opaque=err;
+		}
 	}
-
-	printk("After for loop\n");
+	err=0;
 
 	/* no error: handle positive dentries */
 	if (num_positives>0) {
-		printk("Before interpose\n");
 		err = u2fs_interpose(dentry,dentry->d_sb); //wrapfs_interpose(dentry, dentry->d_sb, &lower_path);
 		if (err) {/* path_put underlying path on error */
-			printk("in lookup interpose failed\n");
 			wrapfs_put_reset_lower_path(dentry);
 		}
 
-		printk("After interpose\n");
 		goto out;
 	}
 
 
-	/* instatiate a new negative dentry */
-	/* Need to set the parent of the negative dentry to the
-	left branch */
-
-	wrapfs_get_lower_path(parent,&lower_parent_path);
-
-
-	lower_dir_dentry = lower_parent_path.dentry;
-	lower_dir_mnt=lower_parent_path.mnt;
-	this.name = name;
-	this.len = strlen(name);
-	this.hash = full_name_hash(this.name, this.len);
-	printk("before the d_lookup method\n");
-	lower_dentry = d_lookup(lower_dir_dentry, &this);
-	if (lower_dentry)
-		goto setup_lower;
-	
-	
-	if(!lower_dentry){
-		err=-EPERM;
-		goto out;
-	}
-
 	/*
-	printk("Did not go to lower\n");
-	lower_dentry = d_alloc(lower_dir_dentry, &this);
-	if (!lower_dentry) {
-		err = -ENOMEM;
+	 * Nothing in any branch: instantiate and hash a negative dentry, so
+	 * that repeated lookups of a missing name are a dcache hit.  Its
+	 * left lower path is the negative left branch dentry of the name,
+	 * which d_revalidate watches, if the parent exists in the left
+	 * branch.  Otherwise the parent is only copied up once something
+	 * gets created under this name (see u2fs_copyup_negative).
+	 */
+	if (!u2fs_has_branch(parent, 0)) {
+		d_add(dentry, NULL);
 		goto out;
 	}
-	d_add(lower_dentry, NULL);*/ 
-
-setup_lower:
-	printk("in the lower\n");
-	lower_path.dentry = lower_dentry;
-	lower_path.mnt = mntget(lower_dir_mnt);
-	if(!lower_path.mnt){
-		printk("In wrapfs lookup this is the shit causing problem\n");
+	wrapfs_get_lower_path(parent,&lower_parent_path);
+	lower_dir_dentry = lower_parent_path.dentry;
+	lower_dir_mnt=lower_parent_path.mnt;
+	if (lower_dir_dentry && lower_dir_dentry->d_inode) {
+		lower_dentry = lookup_lck_len(name, lower_dir_dentry,
+					      dentry->d_name.len);
+		if (IS_ERR(lower_dentry)) {
+			err = PTR_ERR(lower_dentry);
+			goto out;
+		}
+		lower_path.dentry = lower_dentry;
+		lower_path.mnt = mntget(lower_dir_mnt);
+		wrapfs_set_lower_path(dentry, &lower_path);
 	}
-	wrapfs_set_lower_path(dentry, &lower_path);
-
-	/*
-	 * If the intent is to create a file, then don't return an error, so
-	 * the VFS will continue the process of making this negative dentry
-	 * into a positive one.
-	 */
-	if (flags & (LOOKUP_CREATE|LOOKUP_RENAME_TARGET))
-		err = 0;
+	d_add(dentry, NULL);
 
 out:
 	wrapfs_put_lower_path(parent,&lower_parent_path);
+	/* the right branch was whited out, hidden, or we failed early */
+	if (plw && !u2fs_lookup_join(plw, &lower_path))
+		path_put(&lower_path);
 	return ERR_PTR(err);
 	
 }
@@ -542,9 +569,6 @@ struct dentry *wrapfs_lookup(struct inode *dir, struct dentry *dentry,
 	BUG_ON(!nd);
 	parent = dget_parent(dentry);
 
-	printk("In the wrapfs lookup");	
-	printk("Got the parent in lookup\n");
-
 	wrapfs_get_lower_path(parent, &lower_parent_path);
 
 	/* allocate dentry private data.  We free it in ->d_release */
@@ -14,6 +14,7 @@
 
 
 static struct wrapfs_dentry_info *parse_options(struct super_block *sb,char *options){
+	struct wrapfs_sb_info *sbi=WRAPFS_SB(sb);
 
 	struct wrapfs_dentry_info *lower_root_info;
 	char *optname;
@@ -21,13 +22,12 @@ static struct wrapfs_dentry_info *parse_options(struct super_block *sb,char *opt
 	struct path lpath,rpath;
 	int err=0;
 	int i=0;
+	unsigned int mb;
 	
 	lower_root_info=NULL;
 	lpath_name=NULL;
 	rpath_name=NULL;
 
-	printk("Parsing the options\n");
-	
 	lower_root_info=kzalloc(sizeof(struct wrapfs_dentry_info),GFP_KERNEL);
 	if(!lower_root_info){
 		err=-ENOMEM;
@@ -35,7 +35,6 @@ static struct wrapfs_dentry_info *parse_options(struct super_block *sb,char *opt
 	}
 
 	 while((optname=strsep(&options,","))!=NULL){
-                printk("The optname is %s\n",optname);
 		
 		if(!optname)
 			continue;
@@ -58,11 +57,33 @@ static struct wrapfs_dentry_info *parse_options(struct super_block *sb,char *opt
 			if(rpath_name)
 				*rpath_name++='\0';
 		}
+		if(strcmp(optname,"whlegacy")==0)
+			sbi->flags|=U2FS_MNT_WHLEGACY;
+		if(strcmp(optname,"parlookup")==0)
+			sbi->flags|=U2FS_MNT_PARLOOKUP;
+		if(strcmp(optname,"pagecache")==0)
+			sbi->flags|=U2FS_MNT_PAGECACHE;
+		if(strncmp(optname,"rdprefetch=",11)==0){
+			err=kstrtouint(optname+11,10,&sbi->rdprefetch);
+			if(err)
+				goto out_error;
+		}
+		if(strncmp(optname,"lazycopyup=",11)==0){
+			err=kstrtouint(optname+11,10,&mb);
+			if(err)
+				goto out_error;
+			sbi->lazy_min=(loff_t)mb<<20;
+		}
 		i++;
 		
         }
+	/* lazy copy-up reads around the page cache */
+	if(sbi->lazy_min && (sbi->flags & U2FS_MNT_PAGECACHE)){
+		printk(KERN_ERR "u2fs: lazycopyup and pagecache do not mix\n");
+		err=-EINVAL;
+		goto out_error;
+	}
 	if(lpath_name!=NULL && rpath_name!=NULL){
-		printk("paths are %s and %s \n",lpath_name,rpath_name);
 		err=kern_path(lpath_name,LOOKUP_FOLLOW,&lpath);
 		if(err){
 			printk(KERN_ERR "Wrapfs : error accessing the path %s (errno %d)\n",lpath_name,err);
@@ -95,8 +116,8 @@ out:
 
 
 /*
- * There is no need to lock the wrapfs_super_info's rwsem as there is no
- * way anyone can have a reference to the superblock at this point in time.
+ * There is no need to lock the wrapfs_super_info's copy-up queue as there is
+ * no way anyone can have a reference to the superblock at this point in time.
  */
 static int wrapfs_read_super(struct super_block *sb,void *raw_data, int silent)
 {
@@ -114,7 +135,14 @@ static int wrapfs_read_super(struct super_block *sb,void *raw_data, int silent)
 		goto out;
 	}
 	
-	printk("The mount method\n");
+	/* allocate superblock private data */
+	sb->s_fs_info = kzalloc(sizeof(struct wrapfs_sb_info), GFP_KERNEL);
+	if (!WRAPFS_SB(sb)) {
+		printk(KERN_CRIT "wrapfs: read_super: out of memory\n");
+		err = -ENOMEM;
+		goto out;
+	}
+
 	lower_root_info=parse_options(sb,raw_data);
 	if(IS_ERR(lower_root_info)){
 		printk(KERN_ERR 
@@ -138,15 +166,28 @@ static int wrapfs_read_super(struct super_block *sb,void *raw_data, int silent)
 
 	lower_path=lower_root_info->lower_path;
 	lower_path_right=lower_root_info->lower_path_right;
-	
-	/* allocate superblock private data */
-	sb->s_fs_info = kzalloc(sizeof(struct wrapfs_sb_info), GFP_KERNEL);
-	if (!WRAPFS_SB(sb)) {
-		printk(KERN_CRIT "wrapfs: read_super: out of memory\n");
+
+	/* u2fs' own bookkeeping in the branches is done as the mounter */
+	WRAPFS_SB(sb)->cred = prepare_creds();
+	if (!WRAPFS_SB(sb)->cred) {
 		err = -ENOMEM;
-		goto out_free;
+		path_put(&lower_path);
+		path_put(&lower_path_right);
+		goto out_lower_info;
+	}
+
+	/* page cached files are written back through our own bdi */
+	if (WRAPFS_SB(sb)->flags & U2FS_MNT_PAGECACHE) {
+		err = bdi_setup_and_register(&WRAPFS_SB(sb)->bdi, "u2fs",
+					     BDI_CAP_MAP_COPY);
+		if (err) {
+			put_cred(WRAPFS_SB(sb)->cred);
+			path_put(&lower_path);
+			path_put(&lower_path_right);
+			goto out_lower_info;
+		}
+		sb->s_bdi = &WRAPFS_SB(sb)->bdi;
 	}
-	
 
 
 	/* set the lower superblock field of upper superblock */
@@ -171,12 +212,12 @@ static int wrapfs_read_super(struct super_block *sb,void *raw_data, int silent)
 	sb->s_op = &wrapfs_sops;
 
 	/* get a new inode and allocate our root dentry */
-	inode = u2fs_iget(sb); //wrapfs_iget(sb, lower_path.dentry->d_inode);
+	inode = u2fs_iget(sb, lower_path.dentry->d_inode,
+			  lower_path_right.dentry->d_inode);
 	if (IS_ERR(inode)) {
 		err = PTR_ERR(inode);
 		goto out_sput;
 	}
-	inode->i_mode=S_IFDIR|0755;
 	
 	sb->s_root = d_alloc_root(inode);
 	if (!sb->s_root) {
@@ -198,11 +239,17 @@ static int wrapfs_read_super(struct super_block *sb,void *raw_data, int silent)
 	/* set the lower dentries for s_root */
 	wrapfs_set_lower_path(sb->s_root, &lower_path);
 	wrapfs_set_lower_path_right(sb->s_root,&lower_path_right);
+	u2fs_set_branches(sb->s_root, U2FS_BR_ALL);
+
+	/* and pin our own references to the branch roots */
+	pathcpy(&WRAPFS_SB(sb)->lower_root, &lower_path);
+	path_get(&WRAPFS_SB(sb)->lower_root);
+	pathcpy(&WRAPFS_SB(sb)->lower_root_right, &lower_path_right);
+	path_get(&WRAPFS_SB(sb)->lower_root_right);
+	u2fs_rsnap_init(sb);
+	u2fs_cuq_start(sb);
+	u2fs_copyup_recover(sb);
 
-	if(atomic_read(&inode->i_count)<=1){
-		printk("Setting the inode for root");
-		u2fs_fill_inode(sb->s_root,inode);	
-	}
 	/*
 	 * No need to call interpose because we already have a positive
 	 * dentry, which was instantiated by d_alloc_root.  Just need to
@@ -213,6 +260,7 @@ static int wrapfs_read_super(struct super_block *sb,void *raw_data, int silent)
 		printk(KERN_INFO
 		       "wrapfs: mounted on top of %s type %s\n",
 		       dev_name, lower_sb->s_type->name);
+	kfree(lower_root_info);
 	goto out; /* all is well */
 
 	/* no longer needed: free_dentry_private_data(sb->s_root); */
@@ -224,13 +272,15 @@ out_sput:
 	/* drop refs we took earlier */
 	atomic_dec(&lower_sb->s_active);
 	atomic_dec(&lower_sb_right->s_active);
-	kfree(WRAPFS_SB(sb));
-	sb->s_fs_info = NULL;
-out_free:
 	path_put(&lower_path);
 	path_put(&lower_path_right);
+	if (WRAPFS_SB(sb)->flags & U2FS_MNT_PAGECACHE)
+		bdi_destroy(&WRAPFS_SB(sb)->bdi);
+	put_cred(WRAPFS_SB(sb)->cred);
 out_lower_info:
 	kfree(lower_root_info);
+	kfree(WRAPFS_SB(sb));
+	sb->s_fs_info = NULL;
 out:
 	return err;
 }
@@ -244,11 +294,19 @@ struct dentry *wrapfs_mount(struct file_system_type *fs_type, int flags,
 			   wrapfs_read_super);
 }
 
+/* background copy-ups hold dentries, which must be gone by now */
+static void wrapfs_kill_sb(struct super_block *sb)
+{
+	if (WRAPFS_SB(sb))
+		u2fs_cuq_stop(sb);
+	generic_shutdown_super(sb);
+}
+
 static struct file_system_type wrapfs_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= WRAPFS_NAME,
 	.mount		= wrapfs_mount,
-	.kill_sb	= generic_shutdown_super,
+	.kill_sb	= wrapfs_kill_sb,
 	.fs_flags	=FS_REVAL_DOT,
 };
 
@@ -262,6 +320,9 @@ static int __init init_wrapfs_fs(void)
 	if (err)
 		goto out;
 	err = wrapfs_init_dentry_cache();
+	if (err)
+		goto out;
+	err = u2fs_cuq_init();
 	if (err)
 		goto out;
 	err = register_filesystem(&wrapfs_fs_type);
@@ -269,6 +330,7 @@ out:
 	if (err) {
 		wrapfs_destroy_inode_cache();
 		wrapfs_destroy_dentry_cache();
+		u2fs_cuq_exit();
 	}
 	return err;
 }
@@ -277,6 +339,7 @@ static void __exit exit_wrapfs_fs(void)
 {
 	wrapfs_destroy_inode_cache();
 	wrapfs_destroy_dentry_cache();
+	u2fs_cuq_exit();
 	unregister_filesystem(&wrapfs_fs_type);
 	pr_info("Completed wrapfs module unload\n");
 }
@@ -51,3 +51,308 @@ const struct address_space_operations wrapfs_aops = {
 const struct vm_operations_struct wrapfs_vm_ops = {
 	.fault		= wrapfs_fault,
 };
+
+/*
+ * Page cached files ("pagecache" mount option).  These keep their data in
+ * u2fs' own page cache, so readahead, mincore, fadvise and splice see real
+ * pages.  Pages are filled from, and written back to, one private lower
+ * file per inode: writeback has no struct file to go by, and must not
+ * depend on whichever opener happened to dirty a page.  It is opened on
+ * first open and dropped, after writing back, on last release.
+ */
+
+/* the lower file pages of @inode are read from and written to, or NULL */
+static struct file *u2fs_pc_file_get(struct inode *inode)
+{
+	struct file *lower_file;
+
+	spin_lock(&inode->i_lock);
+	lower_file = WRAPFS_I(inode)->pc_file;
+	if (lower_file)
+		get_file(lower_file);
+	spin_unlock(&inode->i_lock);
+	return lower_file;
+}
+
+/*
+ * Open a private lower file for the pages of an inode whose opener got
+ * @lower_file.  The opener's own file will not do: with O_APPEND the
+ * lower file system would write every page back at the end of the file,
+ * and O_DIRECT or O_SYNC have no business in writeback.  Partial page
+ * writes have to read the rest of the page first, so left branch files
+ * are opened read-write; right branch files are only ever read.
+ */
+static struct file *u2fs_pc_open_lower(struct super_block *sb,
+				       struct file *lower_file, int right)
+{
+	const struct cred *cred = WRAPFS_SB(sb)->cred;
+	struct path lower_path;
+
+	pathcpy(&lower_path, &lower_file->f_path);
+	path_get(&lower_path);
+	return dentry_open(lower_path.dentry, lower_path.mnt,
+			   (right ? O_RDONLY : O_RDWR) | O_LARGEFILE, cred);
+}
+
+/* called by ->open of a page cached file, after opening its lower file */
+int u2fs_pc_open(struct file *file)
+{
+	struct inode *inode = file->f_path.dentry->d_inode;
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct file *lower_file, *pc_file, *old = NULL;
+	int right = 0;
+
+	lower_file = wrapfs_lower_file(file);
+	if (!lower_file) {
+		lower_file = wrapfs_lower_file_right(file);
+		right = 1;
+	}
+
+	mutex_lock(&info->pc_mutex);
+	/* a right branch file cannot write back pages of a copied up one */
+	if (!info->pc_file ||
+	    (!(info->pc_file->f_mode & FMODE_WRITE) && !right)) {
+		pc_file = u2fs_pc_open_lower(inode->i_sb, lower_file, right);
+		if (IS_ERR(pc_file)) {
+			mutex_unlock(&info->pc_mutex);
+			return PTR_ERR(pc_file);
+		}
+		spin_lock(&inode->i_lock);
+		old = info->pc_file;
+		info->pc_file = pc_file;
+		spin_unlock(&inode->i_lock);
+	}
+	info->pc_count++;
+	mutex_unlock(&info->pc_mutex);
+
+	if (old)
+		fput(old);
+	return 0;
+}
+
+/* called by ->release of a page cached file */
+void u2fs_pc_release(struct inode *inode)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct file *pc_file = NULL;
+
+	mutex_lock(&info->pc_mutex);
+	if (--info->pc_count == 0) {
+		filemap_write_and_wait(inode->i_mapping);
+		spin_lock(&inode->i_lock);
+		pc_file = info->pc_file;
+		info->pc_file = NULL;
+		spin_unlock(&inode->i_lock);
+	}
+	mutex_unlock(&info->pc_mutex);
+
+	if (pc_file)
+		fput(pc_file);
+}
+
+/* read @page from @lower_file, zero filling past its end */
+static int u2fs_pc_fill(struct file *lower_file, struct page *page)
+{
+	loff_t pos = page_offset(page);
+	size_t done = 0;
+	ssize_t n = 0;
+	mm_segment_t old_fs;
+	char *kaddr;
+
+	kaddr = kmap(page);
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	while (done < PAGE_CACHE_SIZE) {
+		n = vfs_read(lower_file, (char __user *)kaddr + done,
+			     PAGE_CACHE_SIZE - done, &pos);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	set_fs(old_fs);
+	if (n >= 0)
+		memset(kaddr + done, 0, PAGE_CACHE_SIZE - done);
+	kunmap(page);
+	if (n < 0)
+		return n;
+
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+	return 0;
+}
+
+/* write the first @len bytes of @page to @lower_file */
+static int u2fs_pc_flush(struct file *lower_file, struct page *page,
+			 size_t len)
+{
+	loff_t pos = page_offset(page);
+	size_t done = 0;
+	ssize_t n = 0;
+	mm_segment_t old_fs;
+	char *kaddr;
+
+	kaddr = kmap(page);
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	while (done < len) {
+		n = vfs_write(lower_file, (const char __user *)kaddr + done,
+			      len - done, &pos);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	set_fs(old_fs);
+	kunmap(page);
+
+	if (n < 0)
+		return n;
+	return done < len ? -EIO : 0;
+}
+
+static int u2fs_pc_filler(void *data, struct page *page)
+{
+	int err;
+
+	err = u2fs_pc_fill(data, page);
+	if (err)
+		SetPageError(page);
+	unlock_page(page);
+	return err;
+}
+
+static int u2fs_readpage(struct file *file, struct page *page)
+{
+	struct file *lower_file;
+	int err;
+
+	lower_file = u2fs_pc_file_get(page->mapping->host);
+	if (!lower_file) {
+		unlock_page(page);
+		return -EBADF;
+	}
+	err = u2fs_pc_filler(lower_file, page);
+	fput(lower_file);
+	return err;
+}
+
+static int u2fs_readpages(struct file *file, struct address_space *mapping,
+			  struct list_head *pages, unsigned nr_pages)
+{
+	struct file *lower_file;
+	int err;
+
+	lower_file = u2fs_pc_file_get(mapping->host);
+	if (!lower_file)
+		return -EBADF;
+	err = read_cache_pages(mapping, pages, u2fs_pc_filler, lower_file);
+	fput(lower_file);
+	return err;
+}
+
+static int u2fs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	loff_t size = i_size_read(inode);
+	size_t len = PAGE_CACHE_SIZE;
+	struct file *lower_file;
+	int err;
+
+	/* wholly past eof: a truncate is about to throw it away */
+	if (page_offset(page) >= size) {
+		unlock_page(page);
+		return 0;
+	}
+	if (size - page_offset(page) < len)
+		len = size - page_offset(page);
+
+	lower_file = u2fs_pc_file_get(inode);
+	if (!lower_file) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return 0;
+	}
+
+	set_page_writeback(page);
+	unlock_page(page);
+	err = u2fs_pc_flush(lower_file, page, len);
+	if (err) {
+		printk(KERN_ERR "u2fs: writeback of page %lu failed (%d)\n",
+		       page->index, err);
+		SetPageError(page);
+		mapping_set_error(page->mapping, err);
+	}
+	end_page_writeback(page);
+	fput(lower_file);
+	return 0;
+}
+
+static int u2fs_write_begin(struct file *file, struct address_space *mapping,
+			    loff_t pos, unsigned len, unsigned flags,
+			    struct page **pagep, void **fsdata)
+{
+	unsigned from = pos & (PAGE_CACHE_SIZE - 1);
+	struct file *lower_file;
+	struct page *page;
+	int err;
+
+	/* pages are only written back to the left branch */
+	if (file && !wrapfs_lower_file(file))
+		return -EPERM;
+
+	page = grab_cache_page_write_begin(mapping, pos >> PAGE_CACHE_SHIFT,
+					   flags);
+	if (!page)
+		return -ENOMEM;
+	*pagep = page;
+
+	if (PageUptodate(page) || len == PAGE_CACHE_SIZE)
+		return 0;
+	if (page_offset(page) >= i_size_read(mapping->host)) {
+		zero_user_segments(page, 0, from, from + len, PAGE_CACHE_SIZE);
+		return 0;
+	}
+
+	/* a partial write: the rest of the page comes from the lower file */
+	lower_file = u2fs_pc_file_get(mapping->host);
+	err = lower_file ? u2fs_pc_fill(lower_file, page) : -EBADF;
+	if (lower_file)
+		fput(lower_file);
+	if (err) {
+		unlock_page(page);
+		page_cache_release(page);
+	}
+	return err;
+}
+
+static int u2fs_write_end(struct file *file, struct address_space *mapping,
+			  loff_t pos, unsigned len, unsigned copied,
+			  struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+
+	if (!PageUptodate(page)) {
+		/* short copy into a page never read: the caller retries */
+		if (copied < len) {
+			copied = 0;
+			goto out;
+		}
+		SetPageUptodate(page);
+	}
+	if (pos + copied > i_size_read(inode))
+		i_size_write(inode, pos + copied);
+	set_page_dirty(page);
+out:
+	unlock_page(page);
+	page_cache_release(page);
+	return copied;
+}
+
+const struct address_space_operations u2fs_pc_aops = {
+	.readpage	= u2fs_readpage,
+	.readpages	= u2fs_readpages,
+	.writepage	= u2fs_writepage,
+	.writepages	= generic_writepages,
+	.set_page_dirty	= __set_page_dirty_nobuffers,
+	.write_begin	= u2fs_write_begin,
+	.write_end	= u2fs_write_end,
+};
@@ -0,0 +1,787 @@
+/*
+ * Copyright (c) 1998-2011 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2011 Stony Brook University
+ * Copyright (c) 2003-2011 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "wrapfs.h"
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <linux/hash.h>
+
+/*
+ * Union readdir.
+ *
+ * Readdir merges the left and the right branch directory: a name shows
+ * up once, from the topmost branch it exists in, and whiteouts and the
+ * names they hide are dropped.
+ *
+ * Directory offsets are hash cookies, as in ext4's htree directories.
+ * Entries are returned in the order of a 23 bit hash of their name; the
+ * offset of an entry is (hash + 1) << 7 plus its rank among the names
+ * with the same hash, which fits the 31 bits a 32 bit getdents can take.
+ * An offset depends only on the name and its hash neighbours, so it can
+ * be resumed from by any open of the directory, after any amount of
+ * time, by finding the first entry at or after it.  Offsets 0 and 1 are
+ * "." and "..".
+ *
+ * An open directory caches a window of the merged directory: all the
+ * entries whose hash is in [start, end), sorted by offset, at most about
+ * U2FS_RD_WINDOW of them.  Resuming within the window is a binary
+ * search; once it is used up, the next window is merged.  Windows are
+ * merged from snapshots of the branch directories sorted by the same
+ * hash (see below), so merging one only reads its own slice of each
+ * branch, found by a binary search, and resuming at any offset costs
+ * O(log n) plus the size of a window rather than a pass over the whole
+ * directory.
+ */
+
+#define U2FS_RD_HASH_BITS	23
+#define U2FS_RD_RANK_BITS	7
+#define U2FS_RD_RANK_MAX	((1 << U2FS_RD_RANK_BITS) - 1)
+#define U2FS_RD_FIRST		(1 << U2FS_RD_RANK_BITS) /* first hash cookie */
+#define U2FS_RD_NOEND		(1 << U2FS_RD_HASH_BITS) /* window reaches EOF */
+#define U2FS_RD_EOF		0x7fffffff
+#define U2FS_RD_WINDOW		8192
+
+struct u2fs_rdent {
+	u32 hash;
+	u32 pos;			/* the directory offset */
+	u64 ino;
+	char *name;
+	unsigned short len;
+	unsigned char d_type;
+	unsigned char bindex;
+	unsigned char drop;		/* a whiteout, or hidden by one */
+};
+
+struct u2fs_rsnap;
+
+struct u2fs_rdcache {
+	struct u2fs_rdent *ents;	/* sorted by pos once merged */
+	unsigned int nents;
+	unsigned int size;		/* allocated slots in ents */
+	u32 start, end;			/* hash range of the window */
+	struct u2fs_rsnap *lsnap;	/* left branch snapshot, or NULL */
+};
+
+/* state passed to u2fs_rd_filldir while reading one branch */
+struct u2fs_rd_fill {
+	struct u2fs_rdcache *rdc;
+	int bindex;
+	int filldir_called;
+	int err;
+};
+
+/* merge buffers of big directories do not fit in kmalloc */
+static void *u2fs_rd_alloc(size_t size)
+{
+	if (size <= PAGE_SIZE)
+		return kmalloc(size, GFP_KERNEL);
+	return vmalloc(size);
+}
+
+static void u2fs_rd_kfree(void *p)
+{
+	if (is_vmalloc_addr(p))
+		vfree(p);
+	else
+		kfree(p);
+}
+
+static void *u2fs_rd_grow(void *p, size_t len, size_t size)
+{
+	void *q = u2fs_rd_alloc(size);
+
+	if (q && p)
+		memcpy(q, p, len);
+	if (q)
+		u2fs_rd_kfree(p);
+	return q;
+}
+
+static inline u32 u2fs_rd_hash(const char *name, int len)
+{
+	return hash_32(full_name_hash((const unsigned char *)name, len),
+		       U2FS_RD_HASH_BITS);
+}
+
+/* the hash a lower entry is merged under: whiteouts go with their name */
+static inline u32 u2fs_rd_lower_hash(const char *name, int len)
+{
+	if (len >= U2FS_WHLEN && !strncmp(name, U2FS_WHPFX, U2FS_WHLEN))
+		return u2fs_rd_hash(name + U2FS_WHLEN, len - U2FS_WHLEN);
+	return u2fs_rd_hash(name, len);
+}
+
+/* the hash an offset at or after U2FS_RD_FIRST resumes from */
+static inline u32 u2fs_rd_pos_hash(loff_t pos)
+{
+	return (pos >> U2FS_RD_RANK_BITS) - 1;
+}
+
+static int u2fs_rdent_cmp(const void *a, const void *b)
+{
+	const struct u2fs_rdent *x = a, *y = b;
+	int ret;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	ret = memcmp(x->name, y->name, min(x->len, y->len));
+	if (ret)
+		return ret;
+	if (x->len != y->len)
+		return (int)x->len - (int)y->len;
+	/* the topmost branch wins */
+	return (int)x->bindex - (int)y->bindex;
+}
+
+static inline int u2fs_rdent_same(const struct u2fs_rdent *x,
+				  const struct u2fs_rdent *y)
+{
+	return x->hash == y->hash && x->len == y->len &&
+		!memcmp(x->name, y->name, x->len);
+}
+
+/* empty the window, keeping its buffer */
+static void u2fs_rd_clear(struct u2fs_rdcache *rdc)
+{
+	unsigned int i;
+
+	for (i = 0; i < rdc->nents; i++)
+		kfree(rdc->ents[i].name);
+	rdc->nents = 0;
+}
+
+static void u2fs_rsnap_put(struct u2fs_rsnap *snap);
+
+void u2fs_rdcache_free(struct u2fs_rdcache *rdc)
+{
+	if (!rdc)
+		return;
+	u2fs_rd_clear(rdc);
+	if (rdc->lsnap)
+		u2fs_rsnap_put(rdc->lsnap);
+	u2fs_rd_kfree(rdc->ents);
+	kfree(rdc);
+}
+
+/*
+ * Keep the merge buffer bounded: drop the entries of the highest hashes
+ * and shrink the window to end before them.  Whole hash groups go, so a
+ * name and its copies in other branches, or its whiteout, stay together.
+ */
+static void u2fs_rd_trim(struct u2fs_rdcache *rdc)
+{
+	unsigned int i, n;
+	u32 cut;
+
+	sort(rdc->ents, rdc->nents, sizeof(struct u2fs_rdent),
+	     u2fs_rdent_cmp, NULL);
+	cut = rdc->ents[U2FS_RD_WINDOW].hash;
+	for (n = U2FS_RD_WINDOW; n > 0 && rdc->ents[n - 1].hash == cut; n--)
+		;
+	/* a single hash with that many names: nothing sensible to cut */
+	if (!n)
+		return;
+	for (i = n; i < rdc->nents; i++)
+		kfree(rdc->ents[i].name);
+	rdc->nents = n;
+	rdc->end = cut;
+}
+
+static int u2fs_rd_filldir(void *dirent, const char *name, int namelen,
+			   loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct u2fs_rd_fill *buf = dirent;
+	struct u2fs_rdcache *rdc = buf->rdc;
+	struct u2fs_rdent *ent;
+	int drop = 0;
+	size_t size;
+	u32 hash;
+	void *p;
+
+	buf->filldir_called++;
+
+	/* we return our own "." and ".." */
+	if (name[0] == '.' &&
+	    (namelen == 1 || (namelen == 2 && name[1] == '.')))
+		return 0;
+
+	if (namelen >= U2FS_WHLEN && !strncmp(name, U2FS_WHPFX, U2FS_WHLEN)) {
+		/*
+		 * Never shown.  A left branch whiteout is merged under the
+		 * name it hides, so that it wins over the right branch entry.
+		 */
+		if (buf->bindex != 0 ||
+		    (namelen >= U2FS_WHRSVLEN &&
+		     !strncmp(name, U2FS_WHRSV, U2FS_WHRSVLEN)))
+			return 0;
+		name += U2FS_WHLEN;
+		namelen -= U2FS_WHLEN;
+		drop = 1;
+	}
+
+	hash = u2fs_rd_hash(name, namelen);
+	if (hash < rdc->start || hash >= rdc->end)
+		return 0;
+
+	if (rdc->nents == rdc->size) {
+		size = rdc->size ? 2 * rdc->size : 64;
+		p = u2fs_rd_grow(rdc->ents, rdc->nents * sizeof(*ent),
+				 size * sizeof(*ent));
+		if (!p)
+			goto out_nomem;
+		rdc->ents = p;
+		rdc->size = size;
+	}
+	ent = &rdc->ents[rdc->nents];
+	ent->name = kmalloc(namelen + 1, GFP_KERNEL);
+	if (!ent->name)
+		goto out_nomem;
+	memcpy(ent->name, name, namelen);
+	ent->name[namelen] = '\0';
+	ent->len = namelen;
+	ent->hash = hash;
+	ent->ino = ino;
+	ent->d_type = d_type;
+	ent->bindex = buf->bindex;
+	ent->drop = drop;
+	if (buf->bindex == 1)
+		ent->ino = (unsigned long)ino ^ U2FS_INO_RIGHT; /* see u2fs_ino */
+	rdc->nents++;
+
+	if (rdc->nents == rdc->size && rdc->nents >= 2 * U2FS_RD_WINDOW)
+		u2fs_rd_trim(rdc);
+	return 0;
+
+out_nomem:
+	buf->err = -ENOMEM;
+	return buf->err;
+}
+
+/*
+ * Turn the merge buffer into the window: keep the topmost copy of each
+ * name, drop whiteouts and what they hide, and give every name its
+ * offset.
+ */
+static void u2fs_rd_finish(struct u2fs_rdcache *rdc)
+{
+	struct u2fs_rdent *ent;
+	unsigned int i, j, n, rank = 0;
+
+	sort(rdc->ents, rdc->nents, sizeof(struct u2fs_rdent),
+	     u2fs_rdent_cmp, NULL);
+	for (i = 1, j = 0; i < rdc->nents; i++) {
+		if (u2fs_rdent_same(&rdc->ents[j], &rdc->ents[i]))
+			rdc->ents[i].drop = 1;
+		else
+			j = i;
+	}
+
+	for (i = 0, n = 0; i < rdc->nents; i++) {
+		ent = &rdc->ents[i];
+		if (ent->drop) {
+			kfree(ent->name);
+			continue;
+		}
+		if (n && rdc->ents[n - 1].hash == ent->hash)
+			rank++;
+		else
+			rank = 0;
+		ent->pos = ((ent->hash + 1) << U2FS_RD_RANK_BITS) |
+			min_t(unsigned int, rank, U2FS_RD_RANK_MAX);
+		rdc->ents[n++] = *ent;
+	}
+	rdc->nents = n;
+}
+
+/* index of the first entry of the window at or after @pos */
+static unsigned int u2fs_rd_search(struct u2fs_rdcache *rdc, loff_t pos)
+{
+	unsigned int lo = 0, hi = rdc->nents, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rdc->ents[mid].pos < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Branch snapshots.
+ *
+ * A snapshot holds the entries of a lower directory, sorted in readdir
+ * order, in a compact form; a window is merged from the slices of the
+ * snapshots that fall into its hash range.
+ *
+ * The right branch is read-only, so its directories only change behind
+ * our back.  The first merge of a right branch directory saves its
+ * snapshot per mount, keyed by the lower inode, for every later merge by
+ * any opener.  Snapshots are dropped by the shrinker, on remount, and by
+ * the U2FS_IOC_DROP_RSNAP ioctl.
+ *
+ * The left branch changes under us, so its snapshot belongs to the open
+ * directory and is taken again when the directory is rewound, which is
+ * when POSIX wants changes to show up.
+ */
+
+struct u2fs_rsnap_ent {
+	u32 hash;			/* u2fs_rd_lower_hash of the name */
+	u64 ino;
+	const char *name;
+	unsigned short len;
+	unsigned char d_type;
+};
+
+struct u2fs_rsnap {
+	struct hlist_node hash;		/* in u2fs_rsnap_cache.hash */
+	struct list_head lru;		/* in u2fs_rsnap_cache.lru */
+	atomic_t count;			/* the cache holds one reference */
+	struct inode *lower_inode;	/* pinned while the snapshot lives */
+	struct u2fs_rsnap_ent *ents;	/* sorted by hash, then name */
+	unsigned int nents;
+	char *names;			/* the names, back to back */
+};
+
+/* state passed to u2fs_rsnap_filldir while taking a snapshot */
+struct u2fs_rsnap_fill {
+	struct u2fs_rsnap_ent *ents;
+	unsigned int nents, ents_size;
+	char *names;
+	size_t names_len, names_size;
+	int filldir_called;
+	int err;
+};
+
+static int u2fs_rsnap_filldir(void *dirent, const char *name, int namelen,
+			      loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct u2fs_rsnap_fill *buf = dirent;
+	struct u2fs_rsnap_ent *ent;
+	size_t size;
+	void *p;
+
+	buf->filldir_called++;
+	if (buf->nents == buf->ents_size) {
+		size = buf->ents_size ? 2 * buf->ents_size : 64;
+		p = u2fs_rd_grow(buf->ents, buf->nents * sizeof(*ent),
+				    size * sizeof(*ent));
+		if (!p)
+			goto out_nomem;
+		buf->ents = p;
+		buf->ents_size = size;
+	}
+	if (buf->names_len + namelen > buf->names_size) {
+		size = max_t(size_t, 2 * buf->names_size,
+			     buf->names_len + namelen + PAGE_SIZE);
+		p = u2fs_rd_grow(buf->names, buf->names_len, size);
+		if (!p)
+			goto out_nomem;
+		buf->names = p;
+		buf->names_size = size;
+	}
+
+	/* names are pointed to once the blob stops moving */
+	ent = &buf->ents[buf->nents++];
+	ent->ino = ino;
+	ent->name = (const char *)buf->names_len;
+	ent->len = namelen;
+	ent->d_type = d_type;
+	memcpy(buf->names + buf->names_len, name, namelen);
+	buf->names_len += namelen;
+	return 0;
+
+out_nomem:
+	buf->err = -ENOMEM;
+	return buf->err;
+}
+
+static int u2fs_rsnap_cmp(const void *a, const void *b)
+{
+	const struct u2fs_rsnap_ent *x = a, *y = b;
+	int ret;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	ret = memcmp(x->name, y->name, min(x->len, y->len));
+	if (ret)
+		return ret;
+	return (int)x->len - (int)y->len;
+}
+
+static void u2fs_rsnap_put(struct u2fs_rsnap *snap)
+{
+	if (!atomic_dec_and_test(&snap->count))
+		return;
+	iput(snap->lower_inode);
+	u2fs_rd_kfree(snap->ents);
+	u2fs_rd_kfree(snap->names);
+	kfree(snap);
+}
+
+/* read the lower directory @lower_file into a new snapshot */
+static struct u2fs_rsnap *u2fs_rsnap_take(struct file *lower_file)
+{
+	struct u2fs_rsnap_fill buf;
+	struct u2fs_rsnap *snap;
+	loff_t pos;
+	unsigned int i;
+	int err;
+
+	memset(&buf, 0, sizeof(buf));
+	pos = vfs_llseek(lower_file, 0, SEEK_SET);
+	if (pos < 0)
+		return ERR_PTR(pos);
+	do {
+		buf.filldir_called = 0;
+		err = vfs_readdir(lower_file, u2fs_rsnap_filldir, &buf);
+		if (buf.err)
+			err = buf.err;
+	} while (err >= 0 && buf.filldir_called);
+	if (err < 0)
+		goto out_free;
+
+	err = -ENOMEM;
+	snap = kzalloc(sizeof(struct u2fs_rsnap), GFP_KERNEL);
+	if (!snap)
+		goto out_free;
+	for (i = 0; i < buf.nents; i++) {
+		buf.ents[i].name = buf.names + (size_t)buf.ents[i].name;
+		buf.ents[i].hash = u2fs_rd_lower_hash(buf.ents[i].name,
+						      buf.ents[i].len);
+	}
+	sort(buf.ents, buf.nents, sizeof(struct u2fs_rsnap_ent),
+	     u2fs_rsnap_cmp, NULL);
+
+	INIT_HLIST_NODE(&snap->hash);
+	INIT_LIST_HEAD(&snap->lru);
+	atomic_set(&snap->count, 1);
+	snap->lower_inode = igrab(lower_file->f_path.dentry->d_inode);
+	snap->ents = buf.ents;
+	snap->nents = buf.nents;
+	snap->names = buf.names;
+	return snap;
+
+out_free:
+	u2fs_rd_kfree(buf.ents);
+	u2fs_rd_kfree(buf.names);
+	return ERR_PTR(err);
+}
+
+static inline struct hlist_head *u2fs_rsnap_bucket(struct u2fs_rsnap_cache *rsc,
+						   struct inode *lower_inode)
+{
+	return &rsc->hash[hash_ptr(lower_inode, U2FS_RSNAP_HASH_BITS)];
+}
+
+/* find the snapshot of @lower_inode, and make it most recently used */
+static struct u2fs_rsnap *__u2fs_rsnap_find(struct u2fs_rsnap_cache *rsc,
+					    struct inode *lower_inode)
+{
+	struct u2fs_rsnap *snap;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(snap, pos, u2fs_rsnap_bucket(rsc, lower_inode),
+			     hash) {
+		if (snap->lower_inode == lower_inode) {
+			atomic_inc(&snap->count);
+			list_move(&snap->lru, &rsc->lru);
+			return snap;
+		}
+	}
+	return NULL;
+}
+
+/* the snapshot of the right branch directory open as @lower_file */
+static struct u2fs_rsnap *u2fs_rsnap_get(struct super_block *sb,
+					 struct file *lower_file)
+{
+	struct u2fs_rsnap_cache *rsc = &WRAPFS_SB(sb)->rsnap;
+	struct inode *lower_inode = lower_file->f_path.dentry->d_inode;
+	struct u2fs_rsnap *snap, *old;
+
+	spin_lock(&rsc->lock);
+	snap = __u2fs_rsnap_find(rsc, lower_inode);
+	spin_unlock(&rsc->lock);
+	if (snap)
+		return snap;
+
+	snap = u2fs_rsnap_take(lower_file);
+	if (IS_ERR(snap))
+		return snap;
+
+	/* somebody may have taken one meanwhile */
+	spin_lock(&rsc->lock);
+	old = __u2fs_rsnap_find(rsc, lower_inode);
+	if (!old) {
+		atomic_inc(&snap->count);
+		hlist_add_head(&snap->hash, u2fs_rsnap_bucket(rsc, lower_inode));
+		list_add(&snap->lru, &rsc->lru);
+		rsc->count++;
+	}
+	spin_unlock(&rsc->lock);
+	if (old) {
+		u2fs_rsnap_put(snap);
+		snap = old;
+	}
+	return snap;
+}
+
+/* drop up to @nr snapshots, least recently used first */
+static void u2fs_rsnap_prune(struct u2fs_rsnap_cache *rsc, unsigned long nr)
+{
+	struct u2fs_rsnap *snap;
+	LIST_HEAD(dispose);
+
+	spin_lock(&rsc->lock);
+	while (nr-- && !list_empty(&rsc->lru)) {
+		snap = list_entry(rsc->lru.prev, struct u2fs_rsnap, lru);
+		hlist_del_init(&snap->hash);
+		list_move(&snap->lru, &dispose);
+		rsc->count--;
+	}
+	spin_unlock(&rsc->lock);
+
+	/* iput may sleep */
+	while (!list_empty(&dispose)) {
+		snap = list_entry(dispose.next, struct u2fs_rsnap, lru);
+		list_del_init(&snap->lru);
+		u2fs_rsnap_put(snap);
+	}
+}
+
+static int u2fs_rsnap_shrink(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct u2fs_rsnap_cache *rsc =
+		container_of(shrink, struct u2fs_rsnap_cache, shrinker);
+
+	if (sc->nr_to_scan) {
+		if (!(sc->gfp_mask & __GFP_FS))
+			return -1;
+		u2fs_rsnap_prune(rsc, sc->nr_to_scan);
+	}
+	return (rsc->count * sysctl_vfs_cache_pressure) / 100;
+}
+
+/* forget every snapshot of the mount, e.g. after the right branch changed */
+void u2fs_rsnap_invalidate(struct super_block *sb)
+{
+	u2fs_rsnap_prune(&WRAPFS_SB(sb)->rsnap, ULONG_MAX);
+}
+
+void u2fs_rsnap_init(struct super_block *sb)
+{
+	struct u2fs_rsnap_cache *rsc = &WRAPFS_SB(sb)->rsnap;
+	int i;
+
+	spin_lock_init(&rsc->lock);
+	for (i = 0; i < (1 << U2FS_RSNAP_HASH_BITS); i++)
+		INIT_HLIST_HEAD(&rsc->hash[i]);
+	INIT_LIST_HEAD(&rsc->lru);
+	rsc->count = 0;
+	rsc->shrinker.shrink = u2fs_rsnap_shrink;
+	rsc->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&rsc->shrinker);
+}
+
+void u2fs_rsnap_destroy(struct super_block *sb)
+{
+	unregister_shrinker(&WRAPFS_SB(sb)->rsnap.shrinker);
+	u2fs_rsnap_invalidate(sb);
+}
+
+/* add the window's slice of @snap to the merge */
+static int u2fs_rd_read_snap(struct u2fs_rsnap *snap, struct u2fs_rd_fill *buf)
+{
+	struct u2fs_rdcache *rdc = buf->rdc;
+	unsigned int lo, hi, mid, i;
+
+	/* only the window's hash range; its end may shrink as we go */
+	lo = 0;
+	hi = snap->nents;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (snap->ents[mid].hash < rdc->start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (i = lo; i < snap->nents && !buf->err &&
+		     snap->ents[i].hash < rdc->end; i++)
+		u2fs_rd_filldir(buf, snap->ents[i].name, snap->ents[i].len, 0,
+				snap->ents[i].ino, snap->ents[i].d_type);
+	return buf->err;
+}
+
+/* add the branch directory open as @lower_file to the merge */
+static int u2fs_rd_read_branch(struct super_block *sb, struct file *lower_file,
+			       struct u2fs_rd_fill *buf)
+{
+	struct u2fs_rdcache *rdc = buf->rdc;
+	struct u2fs_rsnap *snap;
+	int err;
+
+	if (buf->bindex == 0) {
+		if (!rdc->lsnap) {
+			snap = u2fs_rsnap_take(lower_file);
+			if (IS_ERR(snap))
+				return PTR_ERR(snap);
+			rdc->lsnap = snap;
+		}
+		return u2fs_rd_read_snap(rdc->lsnap, buf);
+	}
+
+	snap = u2fs_rsnap_get(sb, lower_file);
+	if (IS_ERR(snap))
+		return PTR_ERR(snap);
+	err = u2fs_rd_read_snap(snap, buf);
+	u2fs_rsnap_put(snap);
+	return err;
+}
+
+/* merge the window of @file's directory starting at hash @start into @rdc */
+static int u2fs_rd_build(struct file *file, struct u2fs_rdcache *rdc, u32 start)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct u2fs_rd_fill buf;
+	struct file *lower_file;
+	int err = 0;
+	int i;
+
+	u2fs_rd_clear(rdc);
+	rdc->start = start;
+	rdc->end = U2FS_RD_NOEND;
+
+	buf.rdc = rdc;
+	buf.err = 0;
+	for (i = 0; i < MAX_BRANCHES && !err; i++) {
+		if (!u2fs_has_branch(dentry, i))
+			continue;
+		lower_file = u2fs_lower_file_idx(file, i);
+		if (IS_ERR(lower_file)) {
+			err = PTR_ERR(lower_file);
+			break;
+		}
+		if (!lower_file)
+			continue;
+		buf.bindex = i;
+		err = u2fs_rd_read_branch(dentry->d_sb, lower_file, &buf);
+	}
+	if (err) {
+		/* an empty range, so that the next call merges again */
+		u2fs_rd_clear(rdc);
+		rdc->end = rdc->start;
+		return err;
+	}
+	u2fs_rd_finish(rdc);
+
+	fsstack_copy_attr_atime(dentry->d_inode,
+				u2fs_lower_inode_top(dentry->d_inode));
+	return 0;
+}
+
+/*
+ * Readdir-plus (the "rdprefetch=N" mount option): look up at most N of
+ * the names a getdents call just returned, so that the stat(2) calls
+ * which usually follow a listing find their dentries and inodes cached.
+ * The VFS holds the directory's i_mutex across readdir, as
+ * lookup_one_len wants.
+ */
+static void u2fs_rd_prefetch(struct file *file, struct u2fs_rdcache *rdc,
+			     unsigned int start, unsigned int end,
+			     unsigned int *budget)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct u2fs_rdent *ent;
+	struct dentry *child;
+	unsigned int i;
+
+	for (i = start; i < end && *budget; i++) {
+		ent = &rdc->ents[i];
+		(*budget)--;
+		child = lookup_one_len(ent->name, dentry, ent->len);
+		if (IS_ERR(child)) {
+			*budget = 0;
+			break;
+		}
+		dput(child);
+	}
+}
+
+int u2fs_readdir(struct file *file, void *dirent, filldir_t filldir)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct u2fs_rdcache *rdc = WRAPFS_F(file)->rdcache;
+	unsigned int budget = WRAPFS_SB(dentry->d_sb)->rdprefetch;
+	struct u2fs_rdent *ent;
+	unsigned int i, start;
+	int done = 0;
+	int err;
+
+	if (file->f_pos == 0) {
+		if (filldir(dirent, ".", 1, 0, dentry->d_inode->i_ino,
+			    DT_DIR) < 0)
+			return 0;
+		file->f_pos = 1;
+	}
+	if (file->f_pos == 1) {
+		if (filldir(dirent, "..", 2, 1, parent_ino(dentry),
+			    DT_DIR) < 0)
+			return 0;
+		file->f_pos = U2FS_RD_FIRST;
+		/* reading from the start (again) picks up changes */
+		u2fs_rdcache_free(rdc);
+		rdc = WRAPFS_F(file)->rdcache = NULL;
+	}
+	if (file->f_pos < U2FS_RD_FIRST)
+		file->f_pos = U2FS_RD_FIRST;
+
+	while (!done && file->f_pos < U2FS_RD_EOF) {
+		/* past the last possible cookie */
+		if (u2fs_rd_pos_hash(file->f_pos) >= U2FS_RD_NOEND) {
+			file->f_pos = U2FS_RD_EOF;
+			break;
+		}
+		if (!rdc) {
+			/* an empty window, merged right below */
+			rdc = kzalloc(sizeof(struct u2fs_rdcache), GFP_KERNEL);
+			if (!rdc)
+				return -ENOMEM;
+			WRAPFS_F(file)->rdcache = rdc;
+		}
+		if (u2fs_rd_pos_hash(file->f_pos) < rdc->start ||
+		    u2fs_rd_pos_hash(file->f_pos) >= rdc->end) {
+			err = u2fs_rd_build(file, rdc,
+					    u2fs_rd_pos_hash(file->f_pos));
+			if (err)
+				return err;
+		}
+
+		start = u2fs_rd_search(rdc, file->f_pos);
+		for (i = start; i < rdc->nents; i++) {
+			ent = &rdc->ents[i];
+			if (filldir(dirent, ent->name, ent->len, ent->pos,
+				    ent->ino, ent->d_type) < 0) {
+				done = 1;
+				break;
+			}
+			file->f_pos = ent->pos + 1;
+		}
+		u2fs_rd_prefetch(file, rdc, start, i, &budget);
+
+		/* window used up: go on with the next one */
+		if (!done)
+			file->f_pos = rdc->end == U2FS_RD_NOEND ? U2FS_RD_EOF :
+				(loff_t)(rdc->end + 1) << U2FS_RD_RANK_BITS;
+	}
+	return 0;
+}
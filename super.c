@@ -22,7 +22,6 @@ static void wrapfs_put_super(struct super_block *sb)
 {
 	struct wrapfs_sb_info *spd;
 	struct super_block *s,*s_right;
-	printk("This is while unmounting\n");
 
 	s=NULL;
 	s_right=NULL;
@@ -43,6 +42,14 @@ static void wrapfs_put_super(struct super_block *sb)
 		atomic_dec(&s_right->s_active);
 	}
 
+	u2fs_rsnap_destroy(sb);
+	/* put the lower paths still waiting for a grace period */
+	u2fs_path_put_flush();
+	if (spd->flags & U2FS_MNT_PAGECACHE)
+		bdi_destroy(&spd->bdi);
+	put_cred(spd->cred);
+	path_put(&spd->lower_root);
+	path_put(&spd->lower_root_right);
 	kfree(spd);
 	sb->s_fs_info = NULL;
 }
@@ -81,6 +88,9 @@ static int wrapfs_remount_fs(struct super_block *sb, int *flags, char *options)
 		err = -EINVAL;
 	}
 
+	/* the right branch may have been changed while we were away */
+	if (!err)
+		u2fs_rsnap_invalidate(sb);
 	return err;
 }
 
@@ -97,6 +107,8 @@ static void wrapfs_evict_inode(struct inode *inode)
 
 	truncate_inode_pages(&inode->i_data, 0);
 	end_writeback(inode);
+	u2fs_wh_free(inode);
+	u2fs_lazy_free(inode);
 	/*
 	 * Decrement a reference to a lower_inode, which was incremented
 	 * by our read_inode when it was created initially.
@@ -115,6 +127,21 @@ static void wrapfs_evict_inode(struct inode *inode)
 
 }
 
+/*
+ * Unused inodes stay in the icache, pinning their lower inodes, unless
+ * the lower object is gone: then keeping it would only keep the deleted
+ * lower inode alive.
+ */
+static int wrapfs_drop_inode(struct inode *inode)
+{
+	struct inode *lower_inode = u2fs_lower_inode_top(inode);
+
+	if (!lower_inode || !lower_inode->i_nlink ||
+	    inode_unhashed(lower_inode))
+		return 1;
+	return generic_drop_inode(inode);
+}
+
 static struct inode *wrapfs_alloc_inode(struct super_block *sb)
 {
 	struct wrapfs_inode_info *i;
@@ -125,16 +152,26 @@ static struct inode *wrapfs_alloc_inode(struct super_block *sb)
 
 	/* memset everything up to the inode to 0 */
 	memset(i, 0, offsetof(struct wrapfs_inode_info, vfs_inode));
+	mutex_init(&i->wh_mutex);
+	mutex_init(&i->pc_mutex);
 
 	i->vfs_inode.i_version = 1;
 	return &i->vfs_inode;
 }
 
-static void wrapfs_destroy_inode(struct inode *inode)
+static void wrapfs_i_callback(struct rcu_head *head)
 {
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
 	kmem_cache_free(wrapfs_inode_cachep, WRAPFS_I(inode));
 }
 
+/* inodes are freed after a grace period, since RCU-walk may use them */
+static void wrapfs_destroy_inode(struct inode *inode)
+{
+	call_rcu(&inode->i_rcu, wrapfs_i_callback);
+}
+
 /* wrapfs inode cache constructor */
 static void init_once(void *obj)
 {
@@ -159,6 +196,8 @@ int wrapfs_init_inode_cache(void)
 /* wrapfs inode cache destructor */
 void wrapfs_destroy_inode_cache(void)
 {
+	/* wait for pending wrapfs_i_callback calls */
+	rcu_barrier();
 	if (wrapfs_inode_cachep)
 		kmem_cache_destroy(wrapfs_inode_cachep);
 }
@@ -190,5 +229,5 @@ const struct super_operations wrapfs_sops = {
 	.show_options	= generic_show_options,
 	.alloc_inode	= wrapfs_alloc_inode,
 	.destroy_inode	= wrapfs_destroy_inode,
-	.drop_inode	= generic_delete_inode,
+	.drop_inode	= wrapfs_drop_inode,
 };
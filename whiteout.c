@@ -0,0 +1,804 @@
+/*
+ * Copyright (c) 1998-2011 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2011 Stony Brook University
+ * Copyright (c) 2003-2011 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "wrapfs.h"
+
+/*
+ * Whiteouts are stored per directory: the name <name> is whited out in a
+ * directory when a file ".wh.<name>" exists in that directory's left
+ * branch counterpart.  Names starting with ".wh..wh." are reserved for
+ * u2fs' own bookkeeping and are never treated as whiteouts.
+ *
+ * Every u2fs directory inode also carries a hash set with the names that
+ * are whited out in it.  The set is filled once from the directory's left
+ * branch counterpart the first time the directory is looked into, and
+ * kept up to date by create_whiteout() and u2fs_wh_remove(), so a
+ * whiteout check during lookup is an in-memory probe whose cost does not
+ * depend on the number of whiteouts.  The table starts out sized for what
+ * that first scan found and doubles whenever it holds more names than it
+ * has buckets.  Checks only take the RCU read lock; changes are made
+ * under wh_mutex and a grown table replaces the old one as a whole.
+ *
+ * Older u2fs versions kept every whiteout in the left branch root as
+ * ".wh.<parent>.<name>" (see alloc_whname).  With the "whlegacy" mount
+ * option those entries are still honored: loading a directory's index
+ * reads them into it, and the first change to the directory writes them
+ * into the per-directory layout, as the mounter, see u2fs_wh_convert().
+ * Lookups never write.  The legacy files themselves are left alone, since
+ * the old scheme cannot tell which of several same-named directories one
+ * belongs to.
+ */
+
+/* state passed to u2fs_wh_filldir while loading an index */
+struct u2fs_wh_readdir {
+	struct u2fs_wh_table *table;
+	const char *prefix;
+	int prefix_len;
+	int filldir_called;
+	int err;
+};
+
+static inline int u2fs_is_dot(const char *name, int namelen)
+{
+	return (namelen == 1 && name[0] == '.') ||
+		(namelen == 2 && name[0] == '.' && name[1] == '.');
+}
+
+static inline struct hlist_head *u2fs_wh_bucket(struct u2fs_wh_table *table,
+						const char *name, int len)
+{
+	unsigned long hash = full_name_hash((const unsigned char *)name, len);
+
+	return &table->buckets[hash & (table->size - 1)];
+}
+
+/* safe under wh_mutex and under the RCU read lock alike */
+static struct u2fs_wh_entry *__u2fs_wh_find(struct u2fs_wh_table *table,
+					    const char *name, int len)
+{
+	struct u2fs_wh_entry *ent;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry_rcu(ent, pos, u2fs_wh_bucket(table, name, len),
+				 hash) {
+		if (ent->len == len && !memcmp(ent->name, name, len))
+			return ent;
+	}
+	return NULL;
+}
+
+/* an empty table with room for @count names */
+static struct u2fs_wh_table *u2fs_wh_alloc_table(unsigned int count)
+{
+	struct u2fs_wh_table *table;
+	unsigned int size = U2FS_WH_HASH_MIN;
+	unsigned int i;
+
+	while (size < count && size < U2FS_WH_HASH_MAX)
+		size <<= 1;
+	table = kmalloc(sizeof(*table) + size * sizeof(struct hlist_head),
+			GFP_KERNEL | __GFP_NOWARN);
+	if (!table)
+		return NULL;
+	table->size = size;
+	table->count = 0;
+	for (i = 0; i < size; i++)
+		INIT_HLIST_HEAD(&table->buckets[i]);
+	return table;
+}
+
+static void __u2fs_wh_free_table(struct u2fs_wh_table *table)
+{
+	struct u2fs_wh_entry *ent;
+	struct hlist_node *pos, *n;
+	unsigned int i;
+
+	for (i = 0; i < table->size; i++) {
+		hlist_for_each_entry_safe(ent, pos, n, &table->buckets[i],
+					  hash) {
+			hlist_del(&ent->hash);
+			kfree(ent);
+		}
+	}
+	kfree(table);
+}
+
+static void u2fs_wh_free_table_rcu(struct rcu_head *head)
+{
+	__u2fs_wh_free_table(container_of(head, struct u2fs_wh_table, rcu));
+}
+
+/*
+ * Replace *@tablep by a copy with twice the buckets.  Readers may still
+ * walk the old table, so it is freed after a grace period.  A table that
+ * cannot grow is only slower, so failures are ignored.
+ */
+static void u2fs_wh_grow(struct u2fs_wh_table **tablep)
+{
+	struct u2fs_wh_table *old = *tablep, *new;
+	struct u2fs_wh_entry *ent, *copy;
+	struct hlist_node *pos;
+	unsigned int i;
+
+	new = u2fs_wh_alloc_table(old->size * 2);
+	if (!new)
+		return;
+	for (i = 0; i < old->size; i++) {
+		hlist_for_each_entry(ent, pos, &old->buckets[i], hash) {
+			copy = kmemdup(ent, sizeof(*ent) + ent->len + 1,
+				       GFP_KERNEL);
+			if (!copy) {
+				__u2fs_wh_free_table(new);
+				return;
+			}
+			hlist_add_head(&copy->hash,
+				       u2fs_wh_bucket(new, copy->name,
+						      copy->len));
+			new->count++;
+		}
+	}
+	rcu_assign_pointer(*tablep, new);
+	call_rcu(&old->rcu, u2fs_wh_free_table_rcu);
+}
+
+/* add @name to *@tablep, which the caller may change */
+static int __u2fs_wh_insert(struct u2fs_wh_table **tablep, const char *name,
+			    int len)
+{
+	struct u2fs_wh_table *table = *tablep;
+	struct u2fs_wh_entry *ent;
+
+	if (__u2fs_wh_find(table, name, len))
+		return 0;
+
+	ent = kmalloc(sizeof(struct u2fs_wh_entry) + len + 1, GFP_KERNEL);
+	if (!ent)
+		return -ENOMEM;
+	ent->len = len;
+	memcpy(ent->name, name, len);
+	ent->name[len] = '\0';
+	hlist_add_head_rcu(&ent->hash, u2fs_wh_bucket(table, name, len));
+
+	/* keep the chains short */
+	if (++table->count > table->size && table->size < U2FS_WH_HASH_MAX)
+		u2fs_wh_grow(tablep);
+	return 0;
+}
+
+static int u2fs_wh_filldir(void *dirent, const char *name, int namelen,
+			   loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct u2fs_wh_readdir *buf = dirent;
+
+	buf->filldir_called++;
+	if (namelen <= buf->prefix_len ||
+	    strncmp(name, buf->prefix, buf->prefix_len))
+		return 0;
+	/* u2fs' own bookkeeping files are not whiteouts */
+	if (namelen >= U2FS_WHRSVLEN &&
+	    !strncmp(name, U2FS_WHRSV, U2FS_WHRSVLEN))
+		return 0;
+
+	buf->err = __u2fs_wh_insert(&buf->table, name + buf->prefix_len,
+				    namelen - buf->prefix_len);
+	return buf->err;
+}
+
+/* allocate the on-disk name ".wh.<name>" of a whiteout */
+static char *u2fs_whname(const char *name, int len)
+{
+	return kasprintf(GFP_KERNEL, U2FS_WHPFX "%.*s", len, name);
+}
+
+/* run @filldir over every entry of the lower directory @lower_path */
+static int u2fs_wh_scan(struct path *lower_path, filldir_t filldir,
+			struct u2fs_wh_readdir *buf)
+{
+	struct file *lower_file;
+	int err;
+
+	/* dentry_open consumes the references we take here */
+	path_get(lower_path);
+	lower_file = dentry_open(lower_path->dentry, lower_path->mnt,
+				 O_RDONLY | O_DIRECTORY, current_cred());
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
+
+	do {
+		buf->filldir_called = 0;
+		err = vfs_readdir(lower_file, filldir, buf);
+		if (buf->err)
+			err = buf->err;
+	} while (err >= 0 && buf->filldir_called);
+	fput(lower_file);
+
+	return err < 0 ? err : 0;
+}
+
+/* create ".wh.<name>" in the lower directory @lower_dir_path */
+static int __u2fs_wh_create(struct path *lower_dir_path, const char *name,
+			    int len)
+{
+	struct dentry *lower_dir_dentry = lower_dir_path->dentry;
+	struct dentry *lower_wh_dentry;
+	char *whname;
+	int err = 0;
+
+	whname = u2fs_whname(name, len);
+	if (!whname)
+		return -ENOMEM;
+
+	mutex_lock_nested(&lower_dir_dentry->d_inode->i_mutex, I_MUTEX_PARENT);
+	lower_wh_dentry = lookup_one_len(whname, lower_dir_dentry,
+					 strlen(whname));
+	if (IS_ERR(lower_wh_dentry)) {
+		err = PTR_ERR(lower_wh_dentry);
+		goto out_unlock;
+	}
+	if (!lower_wh_dentry->d_inode) {
+		err = mnt_want_write(lower_dir_path->mnt);
+		if (!err) {
+			err = vfs_create(lower_dir_dentry->d_inode,
+					 lower_wh_dentry, S_IRUGO, NULL);
+			mnt_drop_write(lower_dir_path->mnt);
+		}
+	}
+	dput(lower_wh_dentry);
+out_unlock:
+	mutex_unlock(&lower_dir_dentry->d_inode->i_mutex);
+	kfree(whname);
+	return err;
+}
+
+/*
+ * Read the legacy ".wh.<parent>.<name>" whiteouts of @dir_dentry out of
+ * the left branch root into *@tablep, and into *@legacyp, which holds the
+ * ones that still have to be written next to the directory, or NULL if
+ * there are none.
+ */
+static int u2fs_wh_load_legacy(struct dentry *dir_dentry,
+			       struct u2fs_wh_table **tablep,
+			       struct u2fs_wh_table **legacyp)
+{
+	struct u2fs_wh_readdir buf;
+	struct u2fs_wh_table *legacy;
+	struct u2fs_wh_entry *ent;
+	struct hlist_node *pos;
+	struct path root_path;
+	char *prefix;
+	int err = 0;
+	unsigned int i;
+
+	legacy = u2fs_wh_alloc_table(0);
+	if (!legacy)
+		return -ENOMEM;
+
+	buf.table = legacy;
+	buf.err = 0;
+	prefix = alloc_whname("", dir_dentry->d_name.name, 0,
+			      dir_dentry->d_name.len);
+	if (IS_ERR(prefix)) {
+		err = PTR_ERR(prefix);
+		goto out_free;
+	}
+	buf.prefix = prefix;
+	buf.prefix_len = strlen(prefix);
+
+	pathcpy(&root_path, u2fs_lower_root(dir_dentry->d_sb, 0));
+	err = u2fs_wh_scan(&root_path, u2fs_wh_filldir, &buf);
+	legacy = buf.table;
+	kfree(prefix);
+	if (err)
+		goto out_free;
+
+	for (i = 0; i < legacy->size && !err; i++) {
+		hlist_for_each_entry(ent, pos, &legacy->buckets[i], hash) {
+			err = __u2fs_wh_insert(tablep, ent->name, ent->len);
+			if (err)
+				break;
+		}
+	}
+	if (err || !legacy->count)
+		goto out_free;
+	*legacyp = legacy;
+	return 0;
+
+out_free:
+	__u2fs_wh_free_table(legacy);
+	return err;
+}
+
+/*
+ * Write the legacy whiteouts loaded for @dir_dentry into its left branch
+ * counterpart, which the caller has made sure exists, before the
+ * directory is changed.  This is done as the mounter, as the whiteouts
+ * are not the caller's.  Those written stay written if one fails, and the
+ * rest are tried again on the next change.  The caller holds the
+ * directory's i_mutex.
+ */
+int u2fs_wh_convert(struct dentry *dir_dentry)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(dir_dentry->d_inode);
+	struct u2fs_wh_table *legacy;
+	struct u2fs_wh_entry *ent;
+	struct hlist_node *pos;
+	const struct cred *old_cred;
+	struct path lower_dir_path;
+	unsigned int i;
+	int err = 0;
+
+	if (!(WRAPFS_SB(dir_dentry->d_sb)->flags & U2FS_MNT_WHLEGACY))
+		return 0;
+
+	mutex_lock(&info->wh_mutex);
+	legacy = info->wh_legacy;
+	if (!legacy)
+		goto out_unlock;
+
+	old_cred = override_creds(WRAPFS_SB(dir_dentry->d_sb)->cred);
+	wrapfs_get_lower_path(dir_dentry, &lower_dir_path);
+	if (!lower_dir_path.dentry || !lower_dir_path.dentry->d_inode)
+		err = -ENOENT;
+	for (i = 0; i < legacy->size && !err; i++) {
+		hlist_for_each_entry(ent, pos, &legacy->buckets[i], hash) {
+			err = __u2fs_wh_create(&lower_dir_path, ent->name,
+					       ent->len);
+			if (err)
+				break;
+		}
+	}
+	wrapfs_put_lower_path(dir_dentry, &lower_dir_path);
+	revert_creds(old_cred);
+
+	if (!err) {
+		info->wh_legacy = NULL;
+		__u2fs_wh_free_table(legacy);
+	}
+out_unlock:
+	mutex_unlock(&info->wh_mutex);
+	return err;
+}
+
+/*
+ * Read all whiteouts of @dir_dentry from its left branch counterpart into
+ * a freshly allocated table, and publish it.  A directory that does not
+ * exist in the left branch cannot have whiteouts.  The caller holds
+ * wh_mutex.
+ */
+static int u2fs_wh_load(struct dentry *dir_dentry,
+			struct wrapfs_inode_info *info)
+{
+	struct u2fs_wh_readdir buf;
+	struct u2fs_wh_table *table;
+	struct path lower_dir_path;
+	int err = 0;
+
+	table = u2fs_wh_alloc_table(0);
+	if (!table)
+		return -ENOMEM;
+
+	buf.table = table;
+	buf.err = 0;
+	buf.prefix = U2FS_WHPFX;
+	buf.prefix_len = U2FS_WHLEN;
+
+	wrapfs_get_lower_path(dir_dentry, &lower_dir_path);
+	if (lower_dir_path.dentry && lower_dir_path.dentry->d_inode)
+		err = u2fs_wh_scan(&lower_dir_path, u2fs_wh_filldir, &buf);
+	wrapfs_put_lower_path(dir_dentry, &lower_dir_path);
+	table = buf.table;
+	if (err)
+		goto out_free;
+
+	/* the root's legacy whiteouts already use the per-directory name */
+	if ((WRAPFS_SB(dir_dentry->d_sb)->flags & U2FS_MNT_WHLEGACY) &&
+	    !IS_ROOT(dir_dentry)) {
+		err = u2fs_wh_load_legacy(dir_dentry, &table,
+					  &info->wh_legacy);
+		if (err)
+			goto out_free;
+	}
+
+	rcu_assign_pointer(info->wh_table, table);
+	return 0;
+
+out_free:
+	__u2fs_wh_free_table(table);
+	return err;
+}
+
+/*
+ * Check whether @name is whited out in the directory @dir_dentry.
+ *
+ * Returns: 1 if a whiteout exists, 0 if not, -ERRNO on error.
+ */
+int u2fs_wh_lookup(struct dentry *dir_dentry, const struct qstr *name)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(dir_dentry->d_inode);
+	struct u2fs_wh_table *table;
+	int err = 0;
+
+	rcu_read_lock();
+	table = rcu_dereference(info->wh_table);
+	if (table)
+		err = __u2fs_wh_find(table, (const char *)name->name,
+				     name->len) != NULL;
+	rcu_read_unlock();
+	if (table)
+		return err;
+
+	/* the first lookup in the directory loads the index */
+	mutex_lock(&info->wh_mutex);
+	if (!info->wh_table) {
+		err = u2fs_wh_load(dir_dentry, info);
+		if (err)
+			goto out;
+	}
+	if (__u2fs_wh_find(info->wh_table, (const char *)name->name,
+			     name->len))
+		err = 1;
+out:
+	mutex_unlock(&info->wh_mutex);
+	return err;
+}
+
+/* record a whiteout that was just created on disk */
+static int u2fs_wh_add(struct dentry *dir_dentry, const struct qstr *name)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(dir_dentry->d_inode);
+	int err = 0;
+
+	/* if the index is not loaded yet, the next load reads it from disk */
+	mutex_lock(&info->wh_mutex);
+	if (info->wh_table)
+		err = __u2fs_wh_insert(&info->wh_table,
+				       (const char *)name->name, name->len);
+	mutex_unlock(&info->wh_mutex);
+	return err;
+}
+
+/*
+ * Hide @dentry's name in its parent directory by creating a whiteout in
+ * the parent's left branch counterpart, creating that directory chain in
+ * the left branch first if needed.  The caller holds the parent's i_mutex.
+ */
+int create_whiteout(struct dentry *dentry)
+{
+	struct dentry *parent = dentry->d_parent;
+	struct path lower_dir_path;
+	int err;
+
+	err = u2fs_copyup_parents(parent);
+	if (!err)
+		err = u2fs_wh_convert(parent);
+	if (err)
+		return err;
+
+	wrapfs_get_lower_path(parent, &lower_dir_path);
+	err = __u2fs_wh_create(&lower_dir_path,
+			       (const char *)dentry->d_name.name,
+			       dentry->d_name.len);
+	wrapfs_put_lower_path(parent, &lower_dir_path);
+	if (!err)
+		err = u2fs_wh_add(parent, &dentry->d_name);
+	return err;
+}
+
+/*
+ * Remove the whiteout of @name in @dir_dentry once a new object of that
+ * name exists in its left branch counterpart @lower_dir_dentry, so that
+ * the object becomes visible.  Until then the whiteout keeps hiding the
+ * right branch one, so a failed create changes nothing.  The caller holds
+ * the i_mutex of both directories and write access to the left branch,
+ * and has found the whiteout with u2fs_wh_lookup().
+ *
+ * Returns: 0 or -ERRNO.
+ */
+int u2fs_wh_remove(struct dentry *dir_dentry, struct dentry *lower_dir_dentry,
+		   const struct qstr *name)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(dir_dentry->d_inode);
+	struct dentry *lower_wh_dentry;
+	struct u2fs_wh_entry *ent;
+	char *whname;
+	int err = 0;
+
+	whname = u2fs_whname((const char *)name->name, name->len);
+	if (!whname)
+		return -ENOMEM;
+
+	lower_wh_dentry = lookup_one_len(whname, lower_dir_dentry,
+					 strlen(whname));
+	kfree(whname);
+	if (IS_ERR(lower_wh_dentry))
+		return PTR_ERR(lower_wh_dentry);
+	if (lower_wh_dentry->d_inode)
+		err = vfs_unlink(lower_dir_dentry->d_inode, lower_wh_dentry);
+	dput(lower_wh_dentry);
+	if (err)
+		return err;
+
+	mutex_lock(&info->wh_mutex);
+	if (info->wh_table) {
+		ent = __u2fs_wh_find(info->wh_table, (const char *)name->name,
+				     name->len);
+		if (ent) {
+			hlist_del_rcu(&ent->hash);
+			info->wh_table->count--;
+			kfree_rcu(ent, rcu);
+		}
+	}
+	mutex_unlock(&info->wh_mutex);
+	return 0;
+}
+
+/*
+ * Opaque directories.  A directory whose left branch counterpart holds
+ * the file ".wh..wh..opq" hides the right branch directory of the same
+ * name: lookup does not even probe the right branch for it, so neither
+ * its children nor readdir ever see the right branch.
+ */
+
+/* mark the directory @dentry, which exists in the left branch, opaque */
+int u2fs_set_opaque(struct dentry *dentry)
+{
+	struct path lower_path;
+	int err;
+
+	wrapfs_get_lower_path(dentry, &lower_path);
+	err = __u2fs_wh_create(&lower_path, U2FS_WHOPQ + U2FS_WHLEN,
+			       U2FS_WHOPQLEN - U2FS_WHLEN);
+	wrapfs_put_lower_path(dentry, &lower_path);
+	if (!err)
+		WRAPFS_D(dentry)->opaque = 1;
+	return err;
+}
+
+/* does the left branch directory @lower_dentry carry an opaque marker? */
+int u2fs_is_opaque(struct dentry *lower_dentry)
+{
+	struct dentry *lower_opq_dentry;
+	int opaque;
+
+	lower_opq_dentry = lookup_lck_len(U2FS_WHOPQ, lower_dentry,
+					  U2FS_WHOPQLEN);
+	if (IS_ERR(lower_opq_dentry))
+		return PTR_ERR(lower_opq_dentry);
+	opaque = lower_opq_dentry->d_inode != NULL;
+	dput(lower_opq_dentry);
+	return opaque;
+}
+
+/* collect every ".wh." file of a left branch directory, and nothing else */
+static int u2fs_wh_empty_left(void *dirent, const char *name, int namelen,
+			      loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct u2fs_wh_readdir *buf = dirent;
+
+	buf->filldir_called++;
+	if (u2fs_is_dot(name, namelen))
+		return 0;
+	if (namelen <= U2FS_WHLEN || strncmp(name, U2FS_WHPFX, U2FS_WHLEN))
+		buf->err = -ENOTEMPTY;
+	else
+		buf->err = __u2fs_wh_insert(&buf->table, name, namelen);
+	return buf->err;
+}
+
+/* right branch pass of u2fs_wh_empty_dir: every entry must be whited out */
+static int u2fs_wh_empty_right(void *dirent, const char *name, int namelen,
+			       loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct u2fs_wh_readdir *buf = dirent;
+
+	buf->filldir_called++;
+	if (!u2fs_is_dot(name, namelen) &&
+	    !__u2fs_wh_find(buf->table, name, namelen))
+		buf->err = -ENOTEMPTY;
+	return buf->err;
+}
+
+/*
+ * Check that the directory @dentry is empty in the union, i.e. that its
+ * left branch counterpart holds nothing but whiteouts and every entry of
+ * its right branch counterpart is whited out.  Nothing is changed: the
+ * whiteouts go with the directory, see u2fs_wh_rmdir().
+ *
+ * Returns: 1 if the left branch directory holds whiteouts, 0 if it is
+ * empty or there is none, -ENOTEMPTY or -ERRNO.
+ */
+int u2fs_wh_empty_dir(struct dentry *dentry)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(dentry->d_inode);
+	struct u2fs_wh_readdir buf;
+	struct path lower_path;
+	int err = 0;
+
+	buf.err = 0;
+
+	/* the right branch is checked against the directory's index */
+	wrapfs_get_lower_path_right(dentry, &lower_path);
+	if (lower_path.dentry) {
+		mutex_lock(&info->wh_mutex);
+		if (!info->wh_table)
+			err = u2fs_wh_load(dentry, info);
+		if (!err) {
+			buf.table = info->wh_table;
+			err = u2fs_wh_scan(&lower_path, u2fs_wh_empty_right,
+					   &buf);
+		}
+		mutex_unlock(&info->wh_mutex);
+	}
+	wrapfs_put_lower_path(dentry, &lower_path);
+	if (err)
+		return err;
+
+	wrapfs_get_lower_path(dentry, &lower_path);
+	if (lower_path.dentry) {
+		buf.table = u2fs_wh_alloc_table(0);
+		if (!buf.table)
+			err = -ENOMEM;
+		else {
+			err = u2fs_wh_scan(&lower_path, u2fs_wh_empty_left,
+					   &buf);
+			if (!err && buf.table->count)
+				err = 1;
+			__u2fs_wh_free_table(buf.table);
+		}
+	}
+	wrapfs_put_lower_path(dentry, &lower_path);
+	return err;
+}
+
+/*
+ * Remove the directory @lower_dentry, which holds nothing but whiteouts,
+ * from the work area @work.  The caller has write access to the branch.
+ */
+int u2fs_wh_clean(struct dentry *work, struct dentry *lower_dentry,
+		  struct vfsmount *mnt)
+{
+	struct u2fs_wh_readdir buf;
+	struct u2fs_wh_table *table;
+	struct u2fs_wh_entry *ent;
+	struct hlist_node *pos;
+	struct dentry *lower_wh_dentry;
+	struct path lower_path;
+	unsigned int i;
+	int err;
+
+	table = u2fs_wh_alloc_table(0);
+	if (!table)
+		return -ENOMEM;
+	buf.table = table;
+	buf.err = 0;
+	lower_path.dentry = lower_dentry;
+	lower_path.mnt = mnt;
+	err = u2fs_wh_scan(&lower_path, u2fs_wh_empty_left, &buf);
+	table = buf.table;
+	if (err)
+		goto out_free;
+
+	mutex_lock_nested(&lower_dentry->d_inode->i_mutex, I_MUTEX_PARENT);
+	for (i = 0; i < table->size && !err; i++) {
+		hlist_for_each_entry(ent, pos, &table->buckets[i], hash) {
+			lower_wh_dentry = lookup_one_len(ent->name,
+							 lower_dentry,
+							 ent->len);
+			if (IS_ERR(lower_wh_dentry)) {
+				err = PTR_ERR(lower_wh_dentry);
+				break;
+			}
+			if (lower_wh_dentry->d_inode)
+				err = vfs_unlink(lower_dentry->d_inode,
+						 lower_wh_dentry);
+			dput(lower_wh_dentry);
+			if (err)
+				break;
+		}
+	}
+	mutex_unlock(&lower_dentry->d_inode->i_mutex);
+
+	if (!err) {
+		mutex_lock_nested(&work->d_inode->i_mutex, I_MUTEX_PARENT);
+		if (lower_dentry->d_parent == work && lower_dentry->d_inode)
+			err = vfs_rmdir(work->d_inode, lower_dentry);
+		mutex_unlock(&work->d_inode->i_mutex);
+	}
+
+out_free:
+	__u2fs_wh_free_table(table);
+	return err;
+}
+
+/*
+ * Remove the left branch directory @lower_path of @dentry, which holds
+ * whiteouts only.  They must stay until the directory is certain to go,
+ * or a failed rmdir would bring back what they hide, so the directory is
+ * first moved into the work area, which takes it out of the union in one
+ * step, and emptied and removed there.  Whatever a crash leaves behind
+ * there is removed by u2fs_copyup_recover() at the next mount.
+ */
+int u2fs_wh_rmdir(struct dentry *dentry, struct path *lower_path)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct dentry *lower_dentry = lower_path->dentry;
+	struct dentry *lower_dir_dentry, *work, *tmp_dentry, *trap;
+	const struct cred *old_cred;
+	char name[U2FS_WHRMDIRLEN + 2 * sizeof(unsigned long) + 1];
+	int err;
+
+	old_cred = override_creds(WRAPFS_SB(sb)->cred);
+	err = mnt_want_write(lower_path->mnt);
+	if (err)
+		goto out_cred;
+	work = u2fs_workdir(sb, 1);
+	if (IS_ERR(work)) {
+		err = PTR_ERR(work);
+		goto out_drop;
+	}
+
+	/* inode numbers of live directories do not collide */
+	snprintf(name, sizeof(name), U2FS_WHRMDIR "%lx",
+		 lower_dentry->d_inode->i_ino);
+	lower_dir_dentry = dget_parent(lower_dentry);
+	trap = lock_rename(lower_dir_dentry, work);
+	tmp_dentry = lookup_one_len(name, work, strlen(name));
+	if (IS_ERR(tmp_dentry))
+		err = PTR_ERR(tmp_dentry);
+	else {
+		if (tmp_dentry->d_inode)
+			err = -EEXIST;
+		else if (lower_dentry == trap)
+			err = -EINVAL;
+		else
+			err = vfs_rename(lower_dir_dentry->d_inode,
+					 lower_dentry, work->d_inode,
+					 tmp_dentry);
+		dput(tmp_dentry);
+	}
+	unlock_rename(lower_dir_dentry, work);
+	dput(lower_dir_dentry);
+	if (err)
+		goto out_work;
+
+	/* vfs_rename moved lower_dentry into the work area */
+	mutex_lock(&WRAPFS_I(dentry->d_inode)->wh_mutex);
+	u2fs_wh_free(dentry->d_inode);
+	mutex_unlock(&WRAPFS_I(dentry->d_inode)->wh_mutex);
+	if (u2fs_wh_clean(work, lower_dentry, lower_path->mnt))
+		printk(KERN_WARNING "u2fs: could not remove %s from the "
+		       "work area\n", name);
+
+out_work:
+	dput(work);
+out_drop:
+	mnt_drop_write(lower_path->mnt);
+out_cred:
+	revert_creds(old_cred);
+	return err;
+}
+
+/* drop the whiteout index of an inode, called from evict_inode */
+void u2fs_wh_free(struct inode *inode)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct u2fs_wh_table *table = info->wh_table;
+
+	if (table) {
+		rcu_assign_pointer(info->wh_table, NULL);
+		call_rcu(&table->rcu, u2fs_wh_free_table_rcu);
+	}
+	/* unconverted legacy whiteouts are read again by the next load */
+	if (info->wh_legacy) {
+		__u2fs_wh_free_table(info->wh_legacy);
+		info->wh_legacy = NULL;
+	}
+}
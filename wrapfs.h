@@ -25,6 +25,15 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
+#include <linux/cred.h>
+#include <linux/workqueue.h>
+#include <linux/compat.h>
+#include <linux/rcupdate.h>
+#include <linux/rculist.h>
+#include <linux/seqlock.h>
+#include <linux/pagemap.h>
+#include <linux/backing-dev.h>
+#include <linux/ktime.h>
 
 /* the file system name */
 #define WRAPFS_NAME "u2fs"
@@ -34,10 +43,80 @@
 
 #define MAX_BRANCHES 2
 
+/* bits of wrapfs_dentry_info.branches */
+#define U2FS_BR_LEFT	(1 << 0)
+#define U2FS_BR_RIGHT	(1 << 1)
+#define U2FS_BR_ALL	(U2FS_BR_LEFT | U2FS_BR_RIGHT)
+
 #define U2FS_WHLEN 4
 
 #define U2FS_WHPFX ".wh."
 
+/* prefix of u2fs' own bookkeeping files, never a whiteout */
+#define U2FS_WHRSV U2FS_WHPFX U2FS_WHPFX
+#define U2FS_WHRSVLEN (2 * U2FS_WHLEN)
+
+/* marker file of an opaque directory */
+#define U2FS_WHOPQ U2FS_WHRSV ".opq"
+#define U2FS_WHOPQLEN (U2FS_WHRSVLEN + 4)
+
+/* work area of copy-ups in the left branch root, see copyup.c */
+#define U2FS_WHWORK U2FS_WHRSV "work"
+#define U2FS_WHWORKLEN (U2FS_WHRSVLEN + 4)
+
+/* prefix of directories being removed in the work area, see whiteout.c */
+#define U2FS_WHRMDIR "rmdir."
+#define U2FS_WHRMDIRLEN 6
+
+/* ioctls u2fs handles itself on any of its files */
+#define U2FS_IOC_MAGIC		'u'
+#define U2FS_IOC_DROP_RSNAP	_IO(U2FS_IOC_MAGIC, 1)	/* see readdir.c */
+#define U2FS_IOC_COPY_RANGE	_IOW(U2FS_IOC_MAGIC, 2, struct u2fs_copy_range)
+#define U2FS_IOC_CU_STATS	_IOR(U2FS_IOC_MAGIC, 3, struct u2fs_cu_stats)
+
+/* btrfs' clone ioctls, passed on to the lower file, see copyrange.c */
+#define U2FS_IOC_CLONE		_IOW(0x94, 9, int)
+#define U2FS_IOC_CLONE_RANGE	_IOW(0x94, 13, struct u2fs_copy_range)
+
+/* argument of U2FS_IOC_COPY_RANGE, laid out like btrfs' clone range */
+struct u2fs_copy_range {
+	__s64 src_fd;
+	__u64 src_offset;
+	__u64 src_length;	/* 0 for up to the end of the source */
+	__u64 dest_offset;
+};
+
+/* result of U2FS_IOC_CU_STATS, the copy-up queue of the mount */
+struct u2fs_cu_stats {
+	__u32 workers;		/* copy-ups that run at the same time at most */
+	__u32 active;		/* copy-ups running */
+	__u32 queued[2];	/* waiting, speculative and foreground */
+	__u64 requests;		/* queued since mount */
+	__u64 shared;		/* requests that joined one for the same file */
+	__u64 done;
+	__u64 failed;
+	__u64 bytes;		/* copied up, holes included */
+	__u64 busy_ns;		/* time the workers spent copying */
+};
+
+/* mount options kept in wrapfs_sb_info.flags */
+#define U2FS_MNT_WHLEGACY	0x0001	/* honor root-level legacy whiteouts */
+#define U2FS_MNT_PARLOOKUP	0x0002	/* look up both branches in parallel */
+#define U2FS_MNT_PAGECACHE	0x0004	/* cache file data in u2fs' own pages */
+
+/* bits of wrapfs_sb_info.state */
+#define U2FS_SB_DYING		0	/* unmounting, background work stops */
+
+/* xattr of a lazily copied up file's extent map, see lazy.c */
+#define U2FS_EMAP_XATTR		"trusted.u2fs.emap"
+
+/* xattr of an unfinished copy-up's journal, see copyup.c */
+#define U2FS_CU_JOURNAL_XATTR	"trusted.u2fs.cujournal"
+
+/* bounds of the number of hash buckets in a directory's whiteout index */
+#define U2FS_WH_HASH_MIN 16
+#define U2FS_WH_HASH_MAX (1 << 14)
+
 /* useful for tracking code reachability */
 #define UDBG printk(KERN_DEFAULT "DBG:%s:%s:%d\n", __FILE__, __func__, __LINE__)
 
@@ -51,6 +130,8 @@ extern const struct super_operations wrapfs_sops;
 extern const struct dentry_operations wrapfs_dops;
 extern const struct address_space_operations wrapfs_aops, wrapfs_dummy_aops;
 extern const struct vm_operations_struct wrapfs_vm_ops;
+extern const struct file_operations u2fs_pc_fops;
+extern const struct address_space_operations u2fs_pc_aops;
 
 extern int wrapfs_init_inode_cache(void);
 extern void wrapfs_destroy_inode_cache(void);
@@ -58,51 +139,196 @@ extern int wrapfs_init_dentry_cache(void);
 extern void wrapfs_destroy_dentry_cache(void);
 extern int new_dentry_private_data(struct dentry *dentry);
 extern void free_dentry_private_data(struct dentry *dentry);
+extern void u2fs_path_put_rcu(struct path *path);
+extern void u2fs_path_put_flush(void);
 extern struct dentry *wrapfs_lookup(struct inode *dir, struct dentry *dentry,
 				    struct nameidata *nd);
-extern struct inode *wrapfs_iget(struct super_block *sb,
-				 struct inode *lower_inode);
-extern struct inode *u2fs_iget(struct super_block *sb);
-extern int  u2fs_fill_inode(struct dentry *dent,struct inode *inode);
+extern struct inode *u2fs_iget(struct super_block *sb,
+				struct inode *lower_inode,
+				struct inode *lower_inode_right);
 
 extern int u2fs_interpose(struct dentry *dentry, struct super_block *sb);
 extern int wrapfs_interpose(struct dentry *dentry, struct super_block *sb,
 			    struct path *lower_path);
 
 
-extern struct dentry *create_parents(struct inode *dir,struct dentry *dentry,
-					const char*name);
-
 extern char *alloc_whname(const char *name, const char*pname, int len, int plen);
 
+extern int u2fs_wh_lookup(struct dentry *dir_dentry, const struct qstr *name);
+extern int u2fs_wh_remove(struct dentry *dir_dentry,
+			  struct dentry *lower_dir_dentry,
+			  const struct qstr *name);
+extern int create_whiteout(struct dentry *dentry);
+extern int u2fs_wh_convert(struct dentry *dir_dentry);
+extern int u2fs_wh_empty_dir(struct dentry *dentry);
+extern int u2fs_wh_rmdir(struct dentry *dentry, struct path *lower_path);
+extern int u2fs_wh_clean(struct dentry *work, struct dentry *lower_dentry,
+			 struct vfsmount *mnt);
+extern int u2fs_set_opaque(struct dentry *dentry);
+extern int u2fs_is_opaque(struct dentry *lower_dentry);
+extern void u2fs_wh_free(struct inode *inode);
+
+extern struct file *u2fs_lower_file_idx(struct file *file, int bindex);
+extern int u2fs_pc_open(struct file *file);
+extern void u2fs_pc_release(struct inode *inode);
+
+struct u2fs_rdcache;
+extern int u2fs_readdir(struct file *file, void *dirent, filldir_t filldir);
+extern void u2fs_rdcache_free(struct u2fs_rdcache *rdc);
+extern void u2fs_rsnap_init(struct super_block *sb);
+extern void u2fs_rsnap_destroy(struct super_block *sb);
+extern void u2fs_rsnap_invalidate(struct super_block *sb);
+
+extern int u2fs_copyup_parents(struct dentry *dentry);
+extern int u2fs_copyup_negative(struct dentry *dentry);
+extern int u2fs_copyup_file(struct dentry *dentry, loff_t len, int meta);
+extern void u2fs_copyup_recover(struct super_block *sb);
+extern struct dentry *u2fs_workdir(struct super_block *sb, int create);
+
+struct u2fs_emap;
+struct u2fs_cureq;
+extern int u2fs_lazy_create(struct super_block *sb, struct path *tmp_path,
+			    loff_t size);
+extern int u2fs_lazy_open(struct file *file);
+extern ssize_t u2fs_lazy_read(struct file *file, char __user *buf,
+			      size_t count, loff_t *ppos);
+extern ssize_t u2fs_lazy_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos);
+extern loff_t u2fs_lazy_llseek(struct file *file, loff_t offset, int origin);
+extern int u2fs_lazy_truncate(struct dentry *dentry, loff_t size);
+extern int u2fs_lazy_truncate_end(struct dentry *dentry, loff_t size,
+				  int err);
+extern int u2fs_lazy_fill(struct dentry *dentry, loff_t pos, size_t len);
+extern int u2fs_lazy_finish(struct dentry *dentry);
+extern void u2fs_lazy_release(struct file *file);
+extern void u2fs_lazy_free(struct inode *inode);
+
+/* copy-up queue operations and priorities, see cuq.c */
+#define U2FS_CU_COPYUP		0	/* copy a right branch file up */
+#define U2FS_CU_FINISH		1	/* copy the rest of a lazy copy-up */
+#define U2FS_CU_SPECULATIVE	0	/* nobody waits for it */
+#define U2FS_CU_FOREGROUND	1	/* somebody does */
+#define U2FS_CU_NPRIO		2
+
+extern int u2fs_cuq_run(struct dentry *dentry, int op, loff_t len);
+extern void u2fs_cuq_queue(struct dentry *dentry, int op);
+extern void u2fs_cuq_account(struct super_block *sb, loff_t bytes);
+extern long u2fs_cuq_stats(struct super_block *sb, void __user *arg);
+extern void u2fs_cuq_start(struct super_block *sb);
+extern void u2fs_cuq_stop(struct super_block *sb);
+extern int u2fs_cuq_init(void);
+extern void u2fs_cuq_exit(void);
+
+extern loff_t u2fs_copy_lower(struct file *dst, loff_t dst_off,
+			      struct file *src, loff_t src_off, loff_t len);
+extern loff_t u2fs_copy_sparse(struct file *dst, struct file *src,
+			       loff_t pos, loff_t len);
+extern long u2fs_ioctl_copy(struct file *file, unsigned long arg);
+extern long u2fs_ioctl_clone(struct file *file, unsigned int cmd,
+			     unsigned long arg);
+
+/* is @name one that u2fs keeps for itself in the left branch? */
+static inline int u2fs_is_whname(const struct qstr *name)
+{
+	return name->len >= U2FS_WHLEN &&
+		!strncmp((const char *)name->name, U2FS_WHPFX, U2FS_WHLEN);
+}
+
+/* one whited out name in a directory's whiteout index */
+struct u2fs_wh_entry {
+	struct hlist_node hash;
+	struct rcu_head rcu;
+	unsigned int len;
+	char name[0];
+};
+
+/* a directory's whiteout index, see whiteout.c */
+struct u2fs_wh_table {
+	struct rcu_head rcu;
+	unsigned int size;		/* buckets, a power of two */
+	unsigned int count;		/* names */
+	struct hlist_head buckets[0];
+};
+
 /* file private data */
 struct wrapfs_file_info {
 	struct file *lower_file;
 	const struct vm_operations_struct *lower_vm_ops;
 	struct file *lower_file_right;
+	struct u2fs_rdcache *rdcache;	/* merged directory, see readdir.c */
 };
 
 /* wrapfs inode data in memory */
 struct wrapfs_inode_info {
 	struct inode *lower_inode;
 	struct inode *lower_inode_right;
+	struct mutex wh_mutex;		/* serializes changes of wh_table */
+	struct u2fs_wh_table *wh_table;	/* whiteout index, NULL if not loaded;
+					 * read under RCU */
+	struct u2fs_wh_table *wh_legacy; /* legacy whiteouts to write out */
+	struct mutex pc_mutex;		/* protects pc_count */
+	unsigned int pc_count;		/* opens of a page cached file */
+	struct file *pc_file;		/* their lower file, under i_lock */
+	struct u2fs_emap *emap;		/* extent map of a lazy copy-up */
+	int emap_checked;		/* emap is valid, if NULL there is none */
+	struct u2fs_cureq *cureq;	/* copy-up in flight, under cuq.lock */
 	struct inode vfs_inode;
 };
 
 /* wrapfs dentry data in memory */
 struct wrapfs_dentry_info {
-	spinlock_t lock;	/* protects lower_path */
+	spinlock_t lock;	/* serializes writers of the fields below */
+	seqcount_t seq;		/* lets readers copy lower_path* locklessly */
 	struct path lower_path;
 	struct path lower_path_right;
+	int opaque;		/* hides the right branch, see u2fs_set_opaque */
+	unsigned int branches;	/* U2FS_BR_* branches the object exists in */
+	struct rcu_head rcu;	/* freed after a grace period for RCU-walk */
 };
 
 /* wrapfs super-block data in memory */
+/* right branch readdir snapshots of a mount, see readdir.c */
+#define U2FS_RSNAP_HASH_BITS 6
+
+struct u2fs_rsnap_cache {
+	spinlock_t lock;		/* protects hash, lru and count */
+	struct hlist_head hash[1 << U2FS_RSNAP_HASH_BITS];
+	struct list_head lru;
+	unsigned long count;
+	struct shrinker shrinker;
+};
+
+/* copy-ups of a mount, see cuq.c */
+#define U2FS_CUQ_WORKERS 4
+
+struct u2fs_cuq;
+
+struct u2fs_cuq_worker {
+	struct work_struct work;
+	struct u2fs_cuq *cuq;
+};
+
+struct u2fs_cuq {
+	spinlock_t lock;		/* protects all but the workers */
+	struct list_head queue[U2FS_CU_NPRIO];	/* requests not started */
+	unsigned long busy;		/* bit per worker queued or running */
+	struct u2fs_cuq_worker worker[U2FS_CUQ_WORKERS];
+	struct u2fs_cu_stats stats;
+};
+
 struct wrapfs_sb_info {
 	struct super_block *lower_sb;
 	struct super_block *lower_sb_right;
-	struct rw_semaphore rwsem;
-	pid_t write_lock_owner;
-	
+	struct u2fs_cuq cuq;		/* serializes copy-ups of an inode */
+	unsigned int flags;	/* U2FS_MNT_* mount options */
+	unsigned int rdprefetch;	/* lookups per getdents, 0 for none */
+	struct path lower_root;		/* branch roots, pinned until */
+	struct path lower_root_right;	/* put_super */
+	struct u2fs_rsnap_cache rsnap;
+	struct backing_dev_info bdi;	/* writeback of "pagecache" mounts */
+	loff_t lazy_min;		/* copy up lazily from this size, or 0 */
+	const struct cred *cred;	/* the mounter's, for u2fs' own work */
+	unsigned long state;		/* U2FS_SB_* bits */
 };
 
 /*
@@ -158,6 +384,33 @@ static inline struct inode *wrapfs_lower_inode_right(const struct inode *i){
 	return WRAPFS_I(i)->lower_inode_right;
 }
 
+/* lower inode of the topmost branch: the one whose data and attrs we show */
+static inline struct inode *u2fs_lower_inode_top(const struct inode *i)
+{
+	struct inode *lower_inode = wrapfs_lower_inode(i);
+
+	return lower_inode ? lower_inode : wrapfs_lower_inode_right(i);
+}
+
+/* does @inode keep its data in its own page cache? */
+static inline int u2fs_pagecache(const struct inode *inode)
+{
+	return inode->i_mapping->a_ops == &u2fs_pc_aops;
+}
+
+/*
+ * Pages of a page cached file may not have reached the lower file yet;
+ * our own size is the right one until they have.
+ */
+static inline void u2fs_copy_inode_size(struct inode *inode,
+					struct inode *lower_inode)
+{
+	if (mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY) ||
+	    mapping_tagged(inode->i_mapping, PAGECACHE_TAG_WRITEBACK))
+		return;
+	fsstack_copy_inode_size(inode, lower_inode);
+}
+
 static inline void wrapfs_set_lower_inode(struct inode *i, struct inode *val,int idx)
 {
 	if(idx==0)
@@ -168,6 +421,21 @@ static inline void wrapfs_set_lower_inode(struct inode *i, struct inode *val,int
 
 
 
+/*
+ * Inode number of the u2fs inode whose topmost lower inode is @lower_inode
+ * in branch @bindex.  Right branch numbers get the top bit flipped so
+ * they do not collide with left branch ones.
+ */
+#define U2FS_INO_RIGHT (1UL << (BITS_PER_LONG - 1))
+
+static inline unsigned long u2fs_ino(const struct inode *lower_inode,
+				     int bindex)
+{
+	if (bindex == 1)
+		return lower_inode->i_ino ^ U2FS_INO_RIGHT;
+	return lower_inode->i_ino;
+}
+
 /* superblock to lower superblock */
 static inline struct super_block *wrapfs_lower_super(
 	const struct super_block *sb)
@@ -191,6 +459,15 @@ static inline void wrapfs_set_lower_super_right(struct super_block *sb,
 	WRAPFS_SB(sb)->lower_sb_right=val;
 }
 
+/* root of branch @bindex; stays valid for the life of the mount */
+static inline const struct path *u2fs_lower_root(const struct super_block *sb,
+						 int bindex)
+{
+	if (bindex == 1)
+		return &WRAPFS_SB(sb)->lower_root_right;
+	return &WRAPFS_SB(sb)->lower_root;
+}
+
 
 
 /* path based (dentry/mnt) macros */
@@ -215,25 +492,51 @@ static inline void pathcpy(struct path *dst, const struct path *src)
 	dst->dentry = src->dentry;
 	dst->mnt = src->mnt;
 }
+/*
+ * Lower paths are read without taking the dentry's lock: the seqcount
+ * gives a consistent <dentry,mnt> pair, and the RCU read-side section
+ * keeps it alive until we hold our own references.  Writers that drop a
+ * path which readers may still see put it after a grace period, with
+ * u2fs_path_put_rcu().
+ */
+static inline void __wrapfs_get_lower_path(const struct dentry *dent,
+					   const struct path *src,
+					   struct path *lower_path)
+{
+	unsigned seq;
+
+	rcu_read_lock();
+	do {
+		seq = read_seqcount_begin(&WRAPFS_D(dent)->seq);
+		pathcpy(lower_path, src);
+	} while (read_seqcount_retry(&WRAPFS_D(dent)->seq, seq));
+	path_get(lower_path);
+	rcu_read_unlock();
+}
+
 /* Returns struct path.  Caller must path_put it. */
 static inline void wrapfs_get_lower_path(const struct dentry *dent,
 					 struct path *lower_path)
 {
-	spin_lock(&WRAPFS_D(dent)->lock);
-	pathcpy(lower_path, &WRAPFS_D(dent)->lower_path);
-	path_get(lower_path);
-	spin_unlock(&WRAPFS_D(dent)->lock);
-	return;
+	__wrapfs_get_lower_path(dent, &WRAPFS_D(dent)->lower_path,
+				lower_path);
 }
 
 static inline void wrapfs_get_lower_path_right(const struct dentry *dent,
                                          struct path *lower_path)
 {
-        spin_lock(&WRAPFS_D(dent)->lock);
-        pathcpy(lower_path, &WRAPFS_D(dent)->lower_path_right);
-        path_get(lower_path);
-        spin_unlock(&WRAPFS_D(dent)->lock);
-        return;
+	__wrapfs_get_lower_path(dent, &WRAPFS_D(dent)->lower_path_right,
+				lower_path);
+}
+
+/* store @src in @dst, a lower path of @dent; the caller holds its lock */
+static inline void __wrapfs_publish_lower_path(const struct dentry *dent,
+					       struct path *dst,
+					       const struct path *src)
+{
+	write_seqcount_begin(&WRAPFS_D(dent)->seq);
+	pathcpy(dst, src);
+	write_seqcount_end(&WRAPFS_D(dent)->seq);
 }
 
 
@@ -248,6 +551,45 @@ static inline struct dentry* wrapfs_get_lower_dentry_idx(const struct dentry *de
 
 }
 
+/*
+ * Branch presence.  A positive dentry records the branches it exists in,
+ * so that lookups and opens of a directory only go to the branches that
+ * can hold its children.  Set by lookup, copy-up and everything that
+ * creates or renames an object in the left branch.  Readers take no
+ * lock, a stale bit only costs a lower lookup that finds nothing.
+ */
+static inline int u2fs_has_branch(const struct dentry *dent, int bindex)
+{
+	return ACCESS_ONCE(WRAPFS_D(dent)->branches) & (1 << bindex);
+}
+
+static inline void u2fs_set_branches(const struct dentry *dent,
+				     unsigned int branches)
+{
+	spin_lock(&WRAPFS_D(dent)->lock);
+	WRAPFS_D(dent)->branches |= branches;
+	spin_unlock(&WRAPFS_D(dent)->lock);
+}
+
+/*
+ * Lower dentry of branch @i for RCU-walk: no lock and no reference is
+ * taken.  The caller must be in an RCU read-side section, which keeps both
+ * our private data and the lower dentry from being freed.
+ */
+static inline struct dentry *wrapfs_get_lower_dentry_rcu(
+	const struct dentry *dent, int i)
+{
+	struct wrapfs_dentry_info *info = ACCESS_ONCE(dent->d_fsdata);
+
+	if (!info)
+		return NULL;
+	if (i == 0)
+		return ACCESS_ONCE(info->lower_path.dentry);
+	if (i == 1)
+		return ACCESS_ONCE(info->lower_path_right.dentry);
+	return NULL;
+}
+
 static inline void wrapfs_put_lower_path(const struct dentry *dent,
 					 struct path *lower_path)
 {
@@ -258,7 +600,8 @@ static inline void wrapfs_set_lower_path(const struct dentry *dent,
 					 struct path *lower_path)
 {
 	spin_lock(&WRAPFS_D(dent)->lock);
-	pathcpy(&WRAPFS_D(dent)->lower_path, lower_path);
+	__wrapfs_publish_lower_path(dent, &WRAPFS_D(dent)->lower_path,
+				    lower_path);
 	spin_unlock(&WRAPFS_D(dent)->lock);
 	return;
 }
@@ -266,52 +609,59 @@ static inline void wrapfs_set_lower_path(const struct dentry *dent,
 static inline void wrapfs_set_lower_path_right(const struct dentry *dent,
                                          struct path *lower_path)
 {
-        spin_lock(&WRAPFS_D(dent)->lock);
-        pathcpy(&WRAPFS_D(dent)->lower_path_right, lower_path);
-        spin_unlock(&WRAPFS_D(dent)->lock);
-        return;
+	spin_lock(&WRAPFS_D(dent)->lock);
+	__wrapfs_publish_lower_path(dent, &WRAPFS_D(dent)->lower_path_right,
+				    lower_path);
+	spin_unlock(&WRAPFS_D(dent)->lock);
+	return;
 }
 
 
 static inline void wrapfs_reset_lower_path(const struct dentry *dent)
 {
-	WRAPFS_D(dent)->lower_path.mnt = NULL;
+	struct path null_path = { .mnt = NULL, .dentry = NULL };
+
+	spin_lock(&WRAPFS_D(dent)->lock);
+	__wrapfs_publish_lower_path(dent, &WRAPFS_D(dent)->lower_path,
+				    &null_path);
 	spin_unlock(&WRAPFS_D(dent)->lock);
 	return;
 }
 
 static inline void wrapfs_reset_lower_path_right(const struct dentry *dent){
-	spin_lock(&WRAPFS_D(dent)->lock);
-        WRAPFS_D(dent)->lower_path_right.dentry = NULL;
-        WRAPFS_D(dent)->lower_path_right.mnt = NULL;
-        spin_unlock(&WRAPFS_D(dent)->lock);
-        return;
-
+	struct path null_path = { .mnt = NULL, .dentry = NULL };
 
+	spin_lock(&WRAPFS_D(dent)->lock);
+	__wrapfs_publish_lower_path(dent, &WRAPFS_D(dent)->lower_path_right,
+				    &null_path);
+	spin_unlock(&WRAPFS_D(dent)->lock);
+	return;
 }
 
+/*
+ * Called when nobody can look at @dent's lower paths through a reference
+ * any more (->d_release, failed lookup), so no grace period is needed:
+ * RCU-walk readers are covered by the RCU freeing of the dentry info.
+ */
 static inline void wrapfs_put_reset_lower_path(const struct dentry *dent)
 {
 	struct path lower_path, lower_path_right;
 	int x=0,y=0;
 	spin_lock(&WRAPFS_D(dent)->lock);
-	printk("In the spin lock of lower_path and name is %s\n",dent->d_name.name);
 	if(WRAPFS_D(dent)->lower_path.dentry){
-		printk("In the if for lower_path\n");
 		pathcpy(&lower_path, &WRAPFS_D(dent)->lower_path);
 		WRAPFS_D(dent)->lower_path.dentry = NULL;
 		WRAPFS_D(dent)->lower_path.mnt = NULL;
 		x=1;
 	}
 	if(WRAPFS_D(dent)->lower_path_right.dentry){
-                printk("In the if for lower_path_right\n");
                 pathcpy(&lower_path_right, &WRAPFS_D(dent)->lower_path_right);
                 WRAPFS_D(dent)->lower_path_right.dentry = NULL;
                 WRAPFS_D(dent)->lower_path_right.mnt = NULL;
 		y=1;
         }
+	WRAPFS_D(dent)->branches = 0;
 	spin_unlock(&WRAPFS_D(dent)->lock);
-	printk("spin lock released for lower_path\n");
 	if(x==1)
 		path_put(&lower_path);
 	if(y==1)
@@ -320,22 +670,23 @@ static inline void wrapfs_put_reset_lower_path(const struct dentry *dent)
 }
 
 
+/*
+ * Drop the right lower path of a live dentry.  Lockless readers may have
+ * just copied it, so its references are only put after a grace period.
+ */
 static inline void wrapfs_put_reset_lower_path_right(const struct dentry *dent){
-        struct path lower_path;
-        spin_lock(&WRAPFS_D(dent)->lock);
-	printk("In the spin lock for lower_path_right\n");
-	if(WRAPFS_D(dent)->lower_path_right.dentry){
-		printk("In the if for lower_path_right\n");
-        	pathcpy(&lower_path, &WRAPFS_D(dent)->lower_path_right);
-        	WRAPFS_D(dent)->lower_path.dentry = NULL;
-        	WRAPFS_D(dent)->lower_path.mnt = NULL;
-	}
-        spin_unlock(&WRAPFS_D(dent)->lock);
-	printk("Spinlock released for lower_path_right\n");
-        path_put(&lower_path);
-        return;
-
+	struct path null_path = { .mnt = NULL, .dentry = NULL };
+	struct path lower_path;
 
+	spin_lock(&WRAPFS_D(dent)->lock);
+	pathcpy(&lower_path, &WRAPFS_D(dent)->lower_path_right);
+	__wrapfs_publish_lower_path(dent, &WRAPFS_D(dent)->lower_path_right,
+				    &null_path);
+	WRAPFS_D(dent)->branches &= ~U2FS_BR_RIGHT;
+	spin_unlock(&WRAPFS_D(dent)->lock);
+	if (lower_path.dentry)
+		u2fs_path_put_rcu(&lower_path);
+	return;
 }
 
 